@@ -64,7 +64,7 @@ needed = static + ["config", "result", "t_total"]
 
 pickle_jar = "data.p"
 
-encodings = [(4, 0), (3, 1), (5, 2), (6, 3)]
+encodings = [(4, 0), (3, 1), (5, 2), (6, 3), (8, 5)]
 
 tail = "|600|4|1|1"
 
@@ -74,6 +74,8 @@ def load(encoding=False) -> dict:
     if encoding:
         ds = []
         for i, j in encodings:
+            if not glob.glob("data/" + str(i) + "/*.csv"):
+                continue
             d = pd.concat(map(pd.read_csv, glob.glob("data/" + str(i) + "/*.csv")))
             d["config"] = j
             ds.append(d)
@@ -228,7 +230,39 @@ if __name__ == "__main__":
     next(cyc)
     plot("With movement variables", "Without movement variables", "mv")
 
+    # Edge reservation with traversal variables, if evaluated
+    if all(5 in r for r in enc.values()):
+        i, s1, s2 = do(enc, 5, 1)
+        print(
+            out.format(
+                "Traversal edge reservation (5)",
+                "pairwise edge reservation (1)",
+                i,
+                s1,
+                s2,
+                s1 - s2,
+            )
+        )
+        next(cyc)
+        plot("Traversal edge reservation", "Pairwise edge reservation", "tv")
+
+        i, s1, s2 = do(enc, 5, 2)
+        print(
+            out.format(
+                "Traversal edge reservation (5)",
+                "edge variables (2)",
+                i,
+                s1,
+                s2,
+                s1 - s2,
+            )
+        )
+        next(cyc)
+        plot("Traversal edge reservation", "With edge variables", "tv-ev")
+
     for i, j in encodings:
+        if not glob.glob("data/" + str(i) + "/*.csv"):
+            continue
         d = pd.concat(map(pd.read_csv, glob.glob("data/" + str(i) + "/*.csv")))
         out = "Encoding {} needs {:9.1f} clauses, {:9.1f} literals and {:8.1f} variables on average"
         print(
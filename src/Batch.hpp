@@ -0,0 +1,140 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <exception>
+
+#include "util.hpp"
+
+// Runs a batch of independent tasks on a pool of workers. Tasks are dealt round-robin,
+// every worker takes its own tasks front to back and, once out of work, steals from the
+// back of the others. Output is buffered per task and written in the order the tasks
+// were added as soon as all preceding tasks have finished, or, if unordered, as soon as
+// the task has finished.
+class Batch
+{
+public:
+    // Writes to one stream per sink, e.g. console output and result rows
+    typedef std::function<void(vector<std::ostream *> &sinks)> Task;
+
+    static unsigned cores() { return std::max(1u, std::thread::hardware_concurrency()); }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+
+    unsigned n_workers;
+    vector<std::ostream *> sinks;
+    bool ordered;
+
+    vector<Task> tasks;
+
+    std::mutex writer;
+    vector<optional<vector<string>>> output;
+    int written = 0;
+
+    optional<int> take(Queue &q, bool steal)
+    {
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty())
+            return std::nullopt;
+        int ret = steal ? q.tasks.back() : q.tasks.front();
+        steal ? q.tasks.pop_back() : q.tasks.pop_front();
+        return ret;
+    }
+
+    void finish(int i, vector<string> out)
+    {
+        std::lock_guard<std::mutex> lock(writer);
+        if (!ordered)
+        {
+            for (int j : range(sinks))
+                *sinks[j] << out[j] << std::flush;
+            return;
+        }
+        output[i] = std::move(out);
+        for (; written < static_cast<int>(output.size()) && output[written]; ++written)
+        {
+            for (int j : range(sinks))
+                *sinks[j] << output[written]->at(j) << std::flush;
+            output[written].reset();
+        }
+    }
+
+public:
+    Batch(unsigned n_workers, vector<std::ostream *> sinks, bool ordered = true)
+        : n_workers(std::max(1u, n_workers)), sinks(sinks), ordered(ordered) {}
+
+    void add(Task task) { tasks.push_back(std::move(task)); }
+
+    // A single worker writes to the streams directly
+    void run()
+    {
+        if (tasks.empty())
+            return;
+        if (n_workers == 1)
+        {
+            for (auto &task : tasks)
+                task(sinks);
+            tasks.clear();
+            return;
+        }
+
+        vector<Queue> queues(n_workers);
+        for (int i : range(tasks))
+            queues[i % n_workers].tasks.push_back(i);
+        output.assign(tasks.size(), std::nullopt);
+        written = 0;
+
+        std::mutex mutex;
+        std::exception_ptr error;
+
+        auto work = [&](unsigned w)
+        {
+            while (true)
+            {
+                auto i = take(queues[w], false);
+                for (unsigned v = 1; !i && v < n_workers; ++v)
+                    i = take(queues[(w + v) % n_workers], true);
+                if (!i)
+                    return;
+
+                vector<std::stringstream> buffers(sinks.size());
+                vector<std::ostream *> out;
+                for (auto &b : buffers)
+                    out.push_back(&b);
+                try
+                {
+                    tasks[*i](out);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error)
+                        error = std::current_exception();
+                }
+                vector<string> contents;
+                for (auto &b : buffers)
+                    contents.push_back(b.str());
+                finish(*i, std::move(contents));
+            }
+        };
+
+        vector<std::thread> threads;
+        for (int w : range(1, std::min<int>(n_workers, tasks.size())))
+            threads.emplace_back(work, w);
+        work(0);
+        for (auto &t : threads)
+            t.join();
+        tasks.clear();
+
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.hpp"
+
+// Time steps of an encoding stored on disk, one file per key in a directory. The file is
+// named by a hash of the key and mapped into memory. It consists of 32-bit words:
+//
+//   magic, version, key length, key, number of steps, step offsets (one past each step), steps
+//
+// A file whose key differs is treated as missing.
+class Cache
+{
+    static constexpr uint32_t magic = 0x4d415443; // MATC
+    static constexpr uint32_t version = 2;
+
+    string path;
+    vector<int32_t> key;
+
+    const int32_t *data = nullptr;
+    size_t length = 0; // In bytes
+    int n_steps = 0;
+    const uint32_t *offsets = nullptr;
+    const int32_t *steps = nullptr;
+
+    // FNV-1a
+    static uint64_t hash(const vector<int32_t> &key)
+    {
+        uint64_t ret = 0xcbf29ce484222325;
+        for (auto x : key)
+            for (int i : range(4))
+                ret = (ret ^ (static_cast<uint32_t>(x) >> 8 * i & 0xff)) * 0x100000001b3;
+        return ret;
+    }
+
+    void map()
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (!fstat(fd, &st) && st.st_size > 0)
+        {
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                data = static_cast<const int32_t *>(p);
+                length = st.st_size;
+            }
+        }
+        close(fd);
+        if (!data)
+            return;
+
+        size_t n = length / 4, k = key.size(), i = 3 + k;
+        if (n < i + 1 || static_cast<uint32_t>(data[0]) != magic || static_cast<uint32_t>(data[1]) != version ||
+            static_cast<size_t>(data[2]) != k || !std::equal(key.begin(), key.end(), data + 3))
+            return unmap();
+        // The offsets must be sorted and end within the file
+        if (data[i] < 0 || n - i - 1 < static_cast<size_t>(data[i]))
+            return unmap();
+        n_steps = data[i++];
+        offsets = reinterpret_cast<const uint32_t *>(data + i);
+        steps = data + i + n_steps;
+        uint32_t end = 0;
+        for (int t : range(n_steps))
+        {
+            if (offsets[t] < end)
+                return unmap();
+            end = offsets[t];
+        }
+        if (n - i - n_steps < end)
+            return unmap();
+    }
+
+    void unmap()
+    {
+        if (data)
+            munmap(const_cast<int32_t *>(data), length);
+        data = nullptr;
+        length = 0;
+        n_steps = 0;
+    }
+
+public:
+    Cache(const string &directory, vector<int32_t> key) : key(std::move(key))
+    {
+        std::stringstream ss;
+        ss << directory << "/" << std::hex << std::setw(16) << std::setfill('0') << hash(this->key) << ".mat";
+        path = ss.str();
+        map();
+    }
+
+    Cache(const Cache &) = delete;
+    Cache &operator=(const Cache &) = delete;
+
+    ~Cache() { unmap(); }
+
+    int size() const { return n_steps; }
+
+    // Words of step t
+    pair<const int32_t *, const int32_t *> operator[](int t) const
+    {
+        return {steps + (t ? offsets[t - 1] : 0), steps + offsets[t]};
+    }
+
+    // Extends the file by the steps following the cached ones. The file is replaced
+    // atomically, so concurrent readers see either version.
+    void write(const vector<vector<int32_t>> &fresh)
+    {
+        if (fresh.empty())
+            return;
+        vector<int32_t> header = {static_cast<int32_t>(magic), version, static_cast<int32_t>(key.size())};
+        header.insert(header.end(), key.begin(), key.end());
+        header.push_back(n_steps + fresh.size());
+        uint32_t end = n_steps ? offsets[n_steps - 1] : 0;
+        for (int t : range(n_steps))
+            header.push_back(offsets[t]);
+        for (auto &step : fresh)
+            header.push_back(end += step.size());
+
+        std::stringstream ss;
+        ss << path << "." << getpid() << "." << std::this_thread::get_id() << ".tmp";
+        string tmp = ss.str();
+        {
+            std::ofstream out(tmp, std::ios::binary);
+            auto put = [&](const int32_t *begin, size_t n)
+            { out.write(reinterpret_cast<const char *>(begin), n * sizeof(int32_t)); };
+            put(header.data(), header.size());
+            if (n_steps)
+                put(steps, offsets[n_steps - 1]);
+            for (auto &step : fresh)
+                put(step.data(), step.size());
+            if (!out)
+                return (void)std::remove(tmp.c_str());
+        }
+        std::rename(tmp.c_str(), path.c_str());
+    }
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <string_view>
+#include <type_traits>
+
+#include "Problem.hpp"
+
+// Buffered writer of DIMACS. Numbers are formatted straight into the buffer, which is
+// handed to the stream whole once full.
+class Writer
+{
+    std::ostream &out;
+    std::array<char, 1 << 16> buffer;
+    size_t n = 0;
+
+    void reserve(size_t k)
+    {
+        if (n + k > buffer.size())
+            flush();
+    }
+
+public:
+    Writer(std::ostream &out) : out(out) {}
+
+    Writer(const Writer &) = delete;
+    Writer &operator=(const Writer &) = delete;
+
+    ~Writer() { flush(); }
+
+    template <typename T, typename = std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, char>>>
+    Writer &operator<<(T x)
+    {
+        reserve(24);
+        n = std::to_chars(buffer.data() + n, buffer.data() + buffer.size(), x).ptr - buffer.data();
+        return *this;
+    }
+
+    Writer &operator<<(char c)
+    {
+        reserve(1);
+        buffer[n++] = c;
+        return *this;
+    }
+
+    Writer &operator<<(std::string_view s)
+    {
+        reserve(s.size());
+        if (s.size() > buffer.size())
+            out.write(s.data(), s.size());
+        else
+        {
+            std::memcpy(buffer.data() + n, s.data(), s.size());
+            n += s.size();
+        }
+        return *this;
+    }
+
+    void flush()
+    {
+        out.write(buffer.data(), n);
+        n = 0;
+    }
+};
+
+// Positions of the entities up to the given makespan in a model. The model is read in
+// the output format of DIMACS solvers (lines of literals following "v"), the variable
+// map as written by the solver (lines of variable, entity, vertex and time step).
+inline Paths decode(std::istream &var_map, std::istream &model, int n_entities, int makespan)
+{
+    vector<bool> value;
+    string line;
+    while (std::getline(model, line))
+    {
+        if (line.empty() || line[0] != 'v')
+            continue;
+        std::stringstream ss(line.substr(1));
+        long long l;
+        while (ss >> l)
+            if (l > 0)
+            {
+                value.resize(std::max<size_t>(value.size(), l + 1));
+                value[l] = true;
+            }
+    }
+
+    Paths paths(n_entities, vector<int>(makespan + 1, -1));
+    long long x;
+    int e, v, t;
+    while (var_map >> x >> e >> v >> t)
+        if (t <= makespan && x < static_cast<long long>(value.size()) && value[x])
+            paths.at(e).at(t) = v;
+    return paths;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstring>
+#include <cstdint>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware counters of the calling thread and the threads it spawns afterwards, read
+// through perf_event_open. Counters which cannot be opened, e.g. for lack of permission
+// or inside a container, read as zero.
+class Perf
+{
+public:
+    struct Sample
+    {
+        long long instructions = 0, cache_misses = 0, branch_misses = 0;
+
+        Sample &operator+=(const Sample &o)
+        {
+            instructions += o.instructions;
+            cache_misses += o.cache_misses;
+            branch_misses += o.branch_misses;
+            return *this;
+        }
+
+        Sample operator-(const Sample &o) const
+        {
+            return {instructions - o.instructions, cache_misses - o.cache_misses, branch_misses - o.branch_misses};
+        }
+    };
+
+private:
+    static constexpr int N = 3;
+
+    int fd[N] = {-1, -1, -1};
+
+public:
+    Perf()
+    {
+#ifdef __linux__
+        const uint64_t events[N] = {PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        for (int i = 0; i < N; ++i)
+        {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = events[i];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.inherit = 1;
+            fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+#endif
+    }
+
+    Perf(const Perf &) = delete;
+    Perf &operator=(const Perf &) = delete;
+
+    ~Perf()
+    {
+#ifdef __linux__
+        for (int f : fd)
+            if (f >= 0)
+                close(f);
+#endif
+    }
+
+    bool available() const { return fd[0] >= 0 || fd[1] >= 0 || fd[2] >= 0; }
+
+    Sample read() const
+    {
+        long long v[N] = {};
+#ifdef __linux__
+        for (int i = 0; i < N; ++i)
+            if (fd[i] < 0 || ::read(fd[i], &v[i], sizeof(v[i])) != sizeof(v[i]))
+                v[i] = 0;
+#endif
+        return {v[0], v[1], v[2]};
+    }
+};
@@ -7,12 +7,44 @@
 #include <sstream>
 #include <iomanip>
 #include <functional>
+#include <array>
+#include <limits>
+#include <cstdint>
 
 #include "util.hpp"
+#include "Perf.hpp"
 
 struct Problem
 {
-    typedef vector<vector<int>> AdjacencyContainer;
+    // Compressed sparse row adjacency: the neighbours of v are heads[offsets[v]] up to
+    // heads[offsets[v + 1]]. Directed edges are identified by their position in heads.
+    struct AdjacencyContainer
+    {
+        vector<int> offsets = {0}, heads;
+
+        struct Neighbours
+        {
+            const int *first, *last;
+
+            const int *begin() const { return first; }
+            const int *end() const { return last; }
+            size_t size() const { return last - first; }
+            bool empty() const { return first == last; }
+            int operator[](int i) const { return first[i]; }
+        };
+
+        Neighbours operator[](int v) const { return {heads.data() + offsets[v], heads.data() + offsets[v + 1]}; }
+
+        // O(deg(v)), -1 if there is no such edge
+        int id(int v, int w) const
+        {
+            for (int i : range(offsets[v], offsets[v + 1]))
+                if (heads[i] == w)
+                    return i;
+            return -1;
+        }
+    };
+
     typedef vector<pair<int, int>> EdgeContainer;
 
     int grid;
@@ -27,19 +59,39 @@ struct Problem
 
     AdjacencyContainer adj;
 
+    EdgeContainer U;     // Undirected edges, oriented as they first occur in E
+    vector<int> reverse; // Id of the reverse of each directed edge, -1 if absent
+
     void init_adj(int n_vertices, EdgeContainer &edges, bool make_symmetric)
     {
-        adj.resize(n_vertices);
+        vector<vector<int>> lists(n_vertices);
         for (auto e : edges)
         {
             E.push_back(e);
-            adj[e.first].push_back(e.second);
+            lists[e.first].push_back(e.second);
             if (make_symmetric)
             {
                 E.push_back(swap(e));
-                adj[e.second].push_back(e.first);
+                lists[e.second].push_back(e.first);
             }
         }
+        for (auto &l : lists)
+        {
+            adj.heads.insert(adj.heads.end(), l.begin(), l.end());
+            adj.offsets.push_back(adj.heads.size());
+        }
+
+        reverse.assign(adj.heads.size(), -1);
+        for (auto e : E)
+        {
+            int i = adj.id(e.first, e.second);
+            if (reverse[i] >= 0)
+                continue;
+            int j = adj.id(e.second, e.first);
+            if (j >= 0)
+                reverse[i] = j, reverse[j] = i;
+            U.push_back(e);
+        }
     }
 
     void make_grid(std::set<int> &&blockades)
@@ -92,58 +144,125 @@ struct Problem
         make_grid(std::set<int>(nodes.end() - b, nodes.end()));
     }
 
-    vector<vector<optional<int>>> dist;
+    // Dense table with one row of distances per source, unreachable cells hold none
+    struct Distances
+    {
+        static constexpr uint16_t none = std::numeric_limits<uint16_t>::max();
 
-    optional<int> bound(bool pickup = true)
+        int n = 0;
+        vector<uint16_t> cells;
+
+        Distances() = default;
+        Distances(int rows, int n) : n(n), cells(static_cast<size_t>(rows) * n, none) {}
+
+        uint16_t *operator[](int r) { return cells.data() + static_cast<size_t>(r) * n; }
+        const uint16_t *operator[](int r) const { return cells.data() + static_cast<size_t>(r) * n; }
+    };
+
+    // Distances from each source. Up to 64 sources advance together, one bit per source in
+    // a machine word per vertex; only vertices on some frontier are expanded.
+    Distances bfs(const vector<int> &sources) const
     {
-        dist.resize(C_u_A.size(), vector<optional<int>>(V.size()));
-        vector<optional<int>> to_agent(C.size());
-        vector<optional<int>> to_goal(C.size());
-        for (auto e : C_u_A)
+        Distances ret(sources.size(), V.size());
+        vector<uint64_t> seen(V.size()), frontier(V.size()), next(V.size());
+        vector<int> active, reached;
+        for (int b = 0; b < static_cast<int>(sources.size()); b += 64)
         {
-            std::deque<pair<int, int>> q;
-            dist[e][s[e]] = 0;
-            q.push_back({s[e], 0});
-            while (!q.empty())
+            std::fill(seen.begin(), seen.end(), 0);
+            active.clear();
+            for (int i : range(b, std::min<int>(b + 64, sources.size())))
             {
-                int u, d;
-                std::tie(u, d) = q.front();
-                q.pop_front();
-                if (C.contains(e))
-                {
-                    if (!to_goal[e] && u == g[e])
-                        to_goal[e] = d;
-                    if (!to_agent[e])
-                        for (auto a : A)
-                            if (s[a] == u)
-                                to_agent[e] = d;
-                }
-                for (auto v : adj[u])
+                int v = sources[i];
+                if (!frontier[v])
+                    active.push_back(v);
+                frontier[v] |= uint64_t(1) << (i - b);
+                seen[v] |= uint64_t(1) << (i - b);
+                ret[i][v] = 0;
+            }
+            for (int d = 1; !active.empty(); ++d)
+            {
+                reached.clear();
+                for (auto u : active)
+                    for (auto v : adj[u])
+                        if (uint64_t bits = frontier[u] & ~seen[v])
+                        {
+                            if (!next[v])
+                                reached.push_back(v);
+                            next[v] |= bits;
+                            seen[v] |= bits;
+                        }
+                for (auto u : active)
+                    frontier[u] = 0;
+                for (auto v : reached)
                 {
-                    if (dist[e][v])
-                        continue;
-                    dist[e][v] = d + 1;
-                    q.emplace_back(v, d + 1);
+                    for (uint64_t bits = next[v]; bits; bits &= bits - 1)
+                        ret[b + __builtin_ctzll(bits)][v] = d;
+                    frontier[v] = next[v];
+                    next[v] = 0;
                 }
+                std::swap(active, reached);
             }
         }
-        if (!pickup)
-            std::fill(to_agent.begin(), to_agent.end(), 0);
+        return ret;
+    }
+
+    // Distance of each vertex to the nearest source (the graph is symmetric)
+    vector<uint16_t> nearest(const vector<int> &sources) const
+    {
+        vector<uint16_t> ret(V.size(), Distances::none);
+        std::deque<int> q;
+        for (auto v : sources)
+            if (ret[v])
+            {
+                ret[v] = 0;
+                q.push_back(v);
+            }
+        while (!q.empty())
+        {
+            int u = q.front();
+            q.pop_front();
+            for (auto v : adj[u])
+            {
+                if (ret[v] != Distances::none)
+                    continue;
+                ret[v] = ret[u] + 1;
+                q.push_back(v);
+            }
+        }
+        return ret;
+    }
+
+    Distances dist; // From the start of each entity, via the nearest agent for containers
+
+    optional<int> bound(bool pickup = true)
+    {
+        dist = bfs(s);
+        auto to_agent = nearest(vector<int>(s.begin() + C.size(), s.end()));
         optional<int> lower_bound = 0;
         for (auto c : C)
         {
             if (s[c] == g[c])
                 continue;
-            if (!to_goal[c] || (pickup && !to_agent[c]))
+            int to_goal = dist[c][g[c]], agent = pickup ? to_agent[s[c]] : 0;
+            if (to_goal == Distances::none || agent == Distances::none)
                 return std::nullopt;
-            lower_bound = std::max(lower_bound, to_agent[c] + to_goal[c]);
+            lower_bound = std::max(lower_bound.value(), agent + to_goal);
             for (auto v : V)
-                if (v != s[c])
-                    dist[c][v] += to_agent[c];
+                if (v != s[c] && dist[c][v] != Distances::none)
+                    dist[c][v] = std::min(dist[c][v] + agent, Distances::none - 1);
         }
         return lower_bound;
     }
 
+    // Distances to the goal and from the start of each container (the graph is symmetric)
+    Distances to_goal, to_start;
+
+    void backward()
+    {
+        to_goal = bfs(vector<int>(g.begin(), g.begin() + C.size()));
+        to_start = bfs(vector<int>(s.begin(), s.begin() + C.size()));
+    }
+
     void print_edges() const
     {
         for (auto e : E)
@@ -275,10 +394,10 @@ struct Problem
                 else
                     std::cout << "A";
             }
-            else if (!dist[e][v])
+            else if (dist[e][v] == Distances::none)
                 std::cout << "·";
             else
-                std::cout << dist[e][v].value();
+                std::cout << dist[e][v];
             std::cout << BG[0] << FG[0];
             if ((v + 1) % grid == 0)
                 std::cout << "|" << std::endl;
@@ -294,27 +413,123 @@ typedef vector<vector<int>> Paths;
 struct Stats
 {
     long long t_bound = 0, t_extend = 0, t_solver = 0, t_total = 0;
-    int n_clauses = 0, n_variables = 0, n_literals = 0;
-    int initial_bound = 0, lower_bound = 0, upper_bound = -1;
+    int n_clauses = 0, n_variables = 0, n_literals = 0, n_lazy = 0;
+    int initial_bound = 0, lower_bound = 0, upper_bound = -1, n_lifted = 0;
+    int n_cached = 0; // Time steps loaded from the formula cache
+    int encoding = -1; // Winner of the portfolio
+    long long n_conflicts = 0, n_decisions = 0, n_propagations = 0;
+    long long kb_peak_rss = 0, kb_tables = 0; // Of the whole process (see Config::rss) and of the encoder
+    Perf::Sample hw_extend, hw_solver;        // Zero unless Config::perf
+
+    // Constraint families partition the formula, AMO additionally covers the at-most-one
+    // constraints of all families but takes no time of its own. Replayed clauses count
+    // towards the family they were recorded for, REPLAY only takes the time.
+    enum Family
+    {
+        ORIGIN,
+        ASSIGNMENT,
+        UNIQUENESS,
+        VERTEX_RESERVATION,
+        EDGE_VARS,
+        WHEREABOUTS,
+        EDGE_RESERVATION,
+        TRANSPORT,
+        HORIZON,
+        LAZY,
+        REPLAY,
+        AMO,
+        N_FAMILIES,
+    };
+
+    static inline const vector<string> families =
+        {"origin", "assignment", "uniqueness", "vertex_reservation", "edge_vars", "whereabouts", "edge_reservation", "transport", "horizon", "lazy", "replay", "amo"};
+
+    struct Counters
+    {
+        long long t = 0;
+        int n_clauses = 0, n_literals = 0, n_aux = 0;
+
+        Counters &operator+=(const Counters &o)
+        {
+            t += o.t;
+            n_clauses += o.n_clauses;
+            n_literals += o.n_literals;
+            n_aux += o.n_aux;
+            return *this;
+        }
+    };
+
+    std::array<Counters, N_FAMILIES> by_family{};
+
+    // Timeline of the makespan queries, differences over each query
+    struct Query
+    {
+        int t = 0, solver = 0;
+        string result;
+        long long t_start = 0, t_total = 0, t_extend = 0, t_solver = 0;
+        int n_clauses = 0, n_variables = 0, n_lifted = 0;
+        long long n_conflicts = 0, n_decisions = 0, n_propagations = 0;
+    };
+
+    vector<Query> queries;
+
+    static inline const vector<string> query_fields =
+        {"t", "solver", "result", "t_start", "t_total", "t_extend", "t_solver", "n_clauses", "n_variables", "n_lifted", "n_conflicts", "n_decisions", "n_propagations"};
+
+    static vector<pair<string, string>> get_all(const Query &q)
+    {
+        auto str = [](auto v)
+        { return std::to_string(v); };
+        return {{"t", str(q.t)}, {"solver", str(q.solver)}, {"result", q.result}, {"t_start", str(f(q.t_start))}, {"t_total", str(f(q.t_total))}, {"t_extend", str(f(q.t_extend))}, {"t_solver", str(f(q.t_solver))}, {"n_clauses", str(q.n_clauses)}, {"n_variables", str(q.n_variables)}, {"n_lifted", str(q.n_lifted)}, {"n_conflicts", str(q.n_conflicts)}, {"n_decisions", str(q.n_decisions)}, {"n_propagations", str(q.n_propagations)}};
+    }
 
     static inline const std::function<int(long long)> f = [](long long t)
     {
         return t / static_cast<long long>(1e6);
     };
 
-    void print()
+    void print(std::ostream &os = std::cout)
     {
-        std::printf("BFS: %dms, Formula: %dms, SAT: %dms\n", f(t_bound), f(t_extend), f(t_solver));
-        std::printf("Clauses: %d, Variables: %d, Literals: %d\n", n_clauses, n_variables, n_literals);
-        std::printf("Initial bound: %d, Lower bound: %d, Upper bound: %d\n", initial_bound, lower_bound, upper_bound);
+        os << "BFS: " << f(t_bound) << "ms, Formula: " << f(t_extend) << "ms, SAT: " << f(t_solver) << "ms\n";
+        os << "Clauses: " << n_clauses << ", Variables: " << n_variables << ", Literals: " << n_literals << "\n";
+        if (n_lazy)
+            os << "Clauses added eagerly: " << n_clauses - n_lazy << ", lazily: " << n_lazy << "\n";
+        os << "Initial bound: " << initial_bound << ", Lower bound: " << lower_bound << ", Upper bound: " << upper_bound << "\n";
+        if (n_lifted)
+            os << "Makespans refuted on cores: " << n_lifted << "\n";
+        if (n_cached)
+            os << "Time steps loaded from cache: " << n_cached << "\n";
+        os << "Conflicts: " << n_conflicts << ", Decisions: " << n_decisions << ", Propagations: " << n_propagations << "\n";
+        os << "Peak RSS: " << kb_peak_rss << "KB, Encoder tables: " << kb_tables << "KB\n";
+        if (hw_extend.instructions || hw_solver.instructions)
+            os << "Instructions: " << hw_extend.instructions << " + " << hw_solver.instructions
+               << ", Cache misses: " << hw_extend.cache_misses << " + " << hw_solver.cache_misses
+               << ", Branch misses: " << hw_extend.branch_misses << " + " << hw_solver.branch_misses << " (Formula + SAT)\n";
     }
 
-    static inline const vector<string> fields =
-        {"t_bound", "t_extend", "t_solver", "t_total", "n_clauses", "n_variables", "n_literals", "initial_bound", "lower_bound", "upper_bound"};
-
-    vector<pair<string, int>> get_all()
+    static inline const vector<string> fields = []
+    {
+        vector<string> ret = {"t_bound", "t_extend", "t_solver", "t_total", "n_clauses", "n_variables", "n_literals", "n_lazy", "initial_bound", "lower_bound", "upper_bound", "n_lifted", "n_cached", "encoding", "n_conflicts", "n_decisions", "n_propagations", "kb_peak_rss", "kb_tables"};
+        for (auto phase : {"extend", "solver"})
+            for (auto field : {"n_instructions_", "n_cache_misses_", "n_branch_misses_"})
+                ret.push_back(field + string(phase));
+        for (auto &family : families)
+            for (auto field : {"t_", "n_clauses_", "n_literals_", "n_aux_"})
+                ret.push_back(field + family);
+        return ret;
+    }();
+
+    vector<pair<string, long long>> get_all()
     {
-        return {{"t_bound", f(t_bound)}, {"t_extend", f(t_extend)}, {"t_solver", f(t_solver)}, {"t_total", f(t_total)}, {"n_clauses", n_clauses}, {"n_variables", n_variables}, {"n_literals", n_literals}, {"initial_bound", initial_bound}, {"lower_bound", lower_bound}, {"upper_bound", upper_bound}};
+        vector<pair<string, long long>> ret = {{"t_bound", f(t_bound)}, {"t_extend", f(t_extend)}, {"t_solver", f(t_solver)}, {"t_total", f(t_total)}, {"n_clauses", n_clauses}, {"n_variables", n_variables}, {"n_literals", n_literals}, {"n_lazy", n_lazy}, {"initial_bound", initial_bound}, {"lower_bound", lower_bound}, {"upper_bound", upper_bound}, {"n_lifted", n_lifted}, {"n_cached", n_cached}, {"encoding", encoding}, {"n_conflicts", n_conflicts}, {"n_decisions", n_decisions}, {"n_propagations", n_propagations}, {"kb_peak_rss", kb_peak_rss}, {"kb_tables", kb_tables}};
+        for (auto [phase, hw] : {pair<string, Perf::Sample>{"extend", hw_extend}, {"solver", hw_solver}})
+            ret.insert(ret.end(), {{"n_instructions_" + phase, hw.instructions}, {"n_cache_misses_" + phase, hw.cache_misses}, {"n_branch_misses_" + phase, hw.branch_misses}});
+        for (int i : range(N_FAMILIES))
+        {
+            auto &c = by_family[i];
+            ret.insert(ret.end(), {{"t_" + families[i], f(c.t)}, {"n_clauses_" + families[i], c.n_clauses}, {"n_literals_" + families[i], c.n_literals}, {"n_aux_" + families[i], c.n_aux}});
+        }
+        return ret;
     }
 };
 
@@ -5,16 +5,28 @@
 #include <cassert>
 #include <chrono>
 #include <queue>
-#include <unordered_map>
+#include <algorithm>
 #include <cmath>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <stdexcept>
+
+#include <sys/resource.h>
 
 #include <cryptominisat5/cryptominisat.h>
 
 #include "Problem.hpp"
+#include "Dimacs.hpp"
+#include "Cache.hpp"
 
 struct unsolvable_e
 {
-} unsolvable;
+};
 
 struct partially_solved
 {
@@ -31,6 +43,12 @@ struct timeout_e : partially_solved
     string what() override { return "Timeout"; }
 };
 
+struct interrupted_e : partially_solved
+{
+    using partially_solved::partially_solved;
+    string what() override { return "Interrupted"; }
+};
+
 constexpr int max_T = 1 << 8;
 struct maximum_makespan_e : partially_solved
 {
@@ -45,50 +63,441 @@ struct formula_size_e : partially_solved
     string what() override { return "Maximum formula size exceeded"; }
 };
 
+// Sink for Chrome trace events of the logged sequences, one lane per thread. Can be
+// opened in chrome://tracing or Perfetto.
+class Trace
+{
+    std::mutex mutex;
+    std::ostream &out;
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    std::map<std::thread::id, int> lanes;
+
+public:
+    Trace(std::ostream &out) : out(out) { out << "[\n"; }
+
+    ~Trace() { out << "{}]\n" << std::flush; }
+
+    void span(const string &name, std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end)
+    {
+        using namespace std::chrono;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto [lane, added] = lanes.emplace(std::this_thread::get_id(), lanes.size());
+        if (added)
+            out << R"({"name":"thread_name","ph":"M","pid":1,"tid":)" << lane->second
+                << R"(,"args":{"name":"Thread )" << lane->second << "\"}},\n";
+        out << R"({"name":")";
+        for (char c : name)
+            if (c == '"' || c == '\\')
+                out << '\\' << c;
+            else if (c >= ' ')
+                out << c;
+        out << R"(","ph":"X","pid":1,"tid":)" << lane->second
+            << R"(,"ts":)" << duration_cast<microseconds>(begin - origin).count()
+            << R"(,"dur":)" << duration_cast<microseconds>(end - begin).count() << "},\n";
+    }
+};
+
 struct Logger
 {
     bool log;
 
+    Trace *trace = nullptr;
+
     vector<std::chrono::steady_clock::time_point> begin;
+    vector<string> names; // Of the traced sequences
 
     Logger(bool log = true) : log(log) {}
 
-    std::chrono::steady_clock::time_point start_sequence(string message = "")
+    // Sequences are traced by name, defaulting to the message
+    std::chrono::steady_clock::time_point start_sequence(string message = "", string name = "")
     {
-        if (log && message.size())
-            std::cout << message << std::flush;
+        put(message);
+        if (trace)
+        {
+            if (name.empty())
+                name = message.substr(0, message.find_last_not_of(' ') + 1);
+            names.push_back(name);
+        }
         auto start = std::chrono::steady_clock::now();
         begin.push_back(start);
         return start;
     }
 
+    // Loggers of concurrent solvers share stdout, messages are written whole
     void put(string message) const
     {
+        static std::mutex mutex;
         if (log && message.size())
+        {
+            std::lock_guard<std::mutex> lock(mutex);
             std::cout << message << std::flush;
+        }
     }
 
     long long end_sequence(string message = "")
     {
         using namespace std::chrono;
-        auto elapsed = steady_clock::now() - begin.back();
-        begin.pop_back();
-        if (log && message.size())
+        auto end = steady_clock::now();
+        auto elapsed = end - begin.back();
+        if (trace)
         {
-            std::cout << message + "(" << duration_cast<milliseconds>(elapsed).count()
-                      << "ms)\n"
-                      << std::flush;
+            if (names.back().size())
+                trace->span(names.back(), begin.back(), end);
+            names.pop_back();
         }
+        begin.pop_back();
+        if (message.size())
+            put(message + "(" + std::to_string(duration_cast<milliseconds>(elapsed).count()) + "ms)\n");
         return elapsed.count();
     }
 };
 
+// Incremental SAT solver the formula is handed to. Literals and results are exchanged in
+// the types of CryptoMiniSat, which backends translate from if needed.
+class Backend
+{
+public:
+    enum Engine
+    {
+        CRYPTOMINISAT,
+        IPASIR, // Any solver library implementing the IPASIR interface, see the Makefile
+    };
+
+    virtual ~Backend() = default;
+
+    virtual unsigned nVars() const = 0;
+    virtual void new_vars(size_t n) = 0;
+    virtual void add_clause(const vector<CMSat::Lit> &clause) = 0;
+    virtual bool okay() const = 0;
+
+    virtual void set_num_threads(unsigned n) = 0;
+    virtual void set_timeout_all_calls(double s) = 0;
+    virtual void set_max_confl(uint64_t budget) = 0; // Of the following calls
+    virtual CMSat::lbool solve(const vector<CMSat::Lit> *assumptions) = 0;
+
+    virtual const vector<CMSat::lbool> &get_model() const = 0;
+    virtual const vector<CMSat::Lit> &get_conflict() const = 0; // Negated failed assumptions
+
+    virtual uint64_t get_sum_conflicts() = 0;
+    virtual uint64_t get_sum_decisions() = 0;
+    virtual uint64_t get_sum_propagations() = 0;
+
+    // Calls return l_Undef once interrupt is set
+    static std::unique_ptr<Backend> create(Engine engine, std::atomic<bool> *interrupt);
+};
+
+class CryptoMiniSat : public Backend
+{
+    CMSat::SATSolver solver;
+
+public:
+    CryptoMiniSat(std::atomic<bool> *interrupt) : solver(nullptr, interrupt) {}
+
+    unsigned nVars() const override { return solver.nVars(); }
+    void new_vars(size_t n) override { solver.new_vars(n); }
+    void add_clause(const vector<CMSat::Lit> &clause) override { solver.add_clause(clause); }
+    bool okay() const override { return solver.okay(); }
+
+    void set_num_threads(unsigned n) override { solver.set_num_threads(n); }
+    void set_timeout_all_calls(double s) override { solver.set_timeout_all_calls(s); }
+    void set_max_confl(uint64_t budget) override { solver.set_max_confl(budget); }
+    CMSat::lbool solve(const vector<CMSat::Lit> *assumptions) override { return solver.solve(assumptions); }
+
+    const vector<CMSat::lbool> &get_model() const override { return solver.get_model(); }
+    const vector<CMSat::Lit> &get_conflict() const override { return solver.get_conflict(); }
+
+    uint64_t get_sum_conflicts() override { return solver.get_sum_conflicts(); }
+    uint64_t get_sum_decisions() override { return solver.get_sum_decisions(); }
+    uint64_t get_sum_propagations() override { return solver.get_sum_propagations(); }
+};
+
+#ifdef USE_IPASIR
+extern "C"
+{
+    void *ipasir_init();
+    void ipasir_release(void *solver);
+    void ipasir_add(void *solver, int32_t lit_or_zero);
+    void ipasir_assume(void *solver, int32_t lit);
+    int ipasir_solve(void *solver);
+    int32_t ipasir_val(void *solver, int32_t lit);
+    int ipasir_failed(void *solver, int32_t lit);
+    void ipasir_set_terminate(void *solver, void *data, int (*terminate)(void *data));
+    void ipasir_set_learn(void *solver, void *data, int max_length, void (*learn)(void *data, int32_t *clause));
+}
+
+// IPASIR keeps no statistics and has no limits besides termination, which is requested
+// on interrupt, timeout and when the conflict budget is exhausted. Conflicts are counted
+// by the learnt clauses reported, decisions and propagations read as zero. A solver can
+// only use a single thread.
+class Ipasir : public Backend
+{
+    void *solver = ipasir_init();
+    std::atomic<bool> *interrupt;
+
+    unsigned n_vars = 0;
+    vector<CMSat::lbool> model;
+    vector<CMSat::Lit> conflict;
+
+    uint64_t n_conflicts = 0, budget = std::numeric_limits<uint64_t>::max(), limit = 0;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+
+    static int32_t lit(CMSat::Lit l) { return l.sign() ? -static_cast<int32_t>(l.var() + 1) : l.var() + 1; }
+
+public:
+    Ipasir(std::atomic<bool> *interrupt) : interrupt(interrupt)
+    {
+        ipasir_set_terminate(solver, this, [](void *data)
+                             {
+                                 auto &b = *static_cast<Ipasir *>(data);
+                                 return static_cast<int>(*b.interrupt || b.n_conflicts >= b.limit ||
+                                                         b.deadline < std::chrono::steady_clock::now()); });
+        ipasir_set_learn(solver, this, std::numeric_limits<int>::max(), [](void *data, int32_t *)
+                         { ++static_cast<Ipasir *>(data)->n_conflicts; });
+    }
+
+    Ipasir(const Ipasir &) = delete;
+    Ipasir &operator=(const Ipasir &) = delete;
+
+    ~Ipasir() { ipasir_release(solver); }
+
+    unsigned nVars() const override { return n_vars; }
+    void new_vars(size_t n) override { n_vars += n; }
+
+    void add_clause(const vector<CMSat::Lit> &clause) override
+    {
+        for (auto l : clause)
+            ipasir_add(solver, lit(l));
+        ipasir_add(solver, 0);
+    }
+
+    bool okay() const override { return true; }
+
+    void set_num_threads(unsigned) override {}
+
+    void set_timeout_all_calls(double s) override
+    {
+        using namespace std::chrono;
+        deadline = steady_clock::now() + duration_cast<steady_clock::duration>(duration<double>(s));
+    }
+
+    void set_max_confl(uint64_t budget) override { this->budget = budget; }
+
+    CMSat::lbool solve(const vector<CMSat::Lit> *assumptions) override
+    {
+        limit = budget < std::numeric_limits<uint64_t>::max() - n_conflicts ? n_conflicts + budget : budget;
+        if (assumptions)
+            for (auto l : *assumptions)
+                ipasir_assume(solver, lit(l));
+        switch (ipasir_solve(solver))
+        {
+        case 10:
+            model.resize(n_vars);
+            for (unsigned v : range(n_vars))
+            {
+                int32_t val = ipasir_val(solver, v + 1);
+                model[v] = val > 0 ? CMSat::l_True : val < 0 ? CMSat::l_False : CMSat::l_Undef;
+            }
+            return CMSat::l_True;
+        case 20:
+            conflict.clear();
+            if (assumptions)
+                for (auto l : *assumptions)
+                    if (ipasir_failed(solver, lit(l)))
+                        conflict.push_back(~l);
+            return CMSat::l_False;
+        default:
+            return CMSat::l_Undef;
+        }
+    }
+
+    const vector<CMSat::lbool> &get_model() const override { return model; }
+    const vector<CMSat::Lit> &get_conflict() const override { return conflict; }
+
+    uint64_t get_sum_conflicts() override { return n_conflicts; }
+    uint64_t get_sum_decisions() override { return 0; }
+    uint64_t get_sum_propagations() override { return 0; }
+};
+#endif
+
+// Passes the formula on to another backend while writing it, either as iCNF with the
+// assumptions of every call, or as DIMACS of the first call with its assumptions as unit
+// clauses. The DIMACS header is written once the formula is complete, which requires a
+// seekable stream.
+class Export : public Backend
+{
+    std::unique_ptr<Backend> inner; // Empty if the formula is written only
+    std::ostream &stream;
+    Writer out;
+
+    bool incremental;
+    bool closed = false;
+    std::streampos header;
+    static constexpr int header_length = 30; // p cnf, variables and clauses padded
+
+    unsigned n_vars = 0;
+    long long n_clauses = 0;
+
+    const vector<CMSat::lbool> model;
+    const vector<CMSat::Lit> conflict;
+
+    void write(CMSat::Lit l)
+    {
+        if (l.sign())
+            out << '-';
+        out << l.var() + 1;
+    }
+
+    void write(const vector<CMSat::Lit> &clause)
+    {
+        for (auto l : clause)
+        {
+            write(l);
+            out << ' ';
+        }
+        out << "0\n";
+        ++n_clauses;
+    }
+
+    void close()
+    {
+        closed = true;
+        out.flush();
+        auto end = stream.tellp();
+        stream.seekp(header);
+        std::stringstream ss;
+        ss << "p cnf " << std::setw(10) << n_vars << ' ' << std::setw(header_length - 17) << n_clauses;
+        stream << ss.str() << std::flush;
+        stream.seekp(end);
+    }
+
+public:
+    Export(std::unique_ptr<Backend> inner, std::ostream &stream, bool incremental)
+        : inner(std::move(inner)), stream(stream), out(stream), incremental(incremental)
+    {
+        if (incremental)
+        {
+            out << "p inccnf\n";
+            return;
+        }
+        header = stream.tellp();
+        if (header < 0)
+            throw std::runtime_error("DIMACS requires a seekable stream");
+        out << string(header_length, ' ') << '\n';
+    }
+
+    ~Export()
+    {
+        if (!incremental && !closed)
+            close();
+    }
+
+    unsigned nVars() const override { return n_vars; }
+
+    void new_vars(size_t n) override
+    {
+        n_vars += n;
+        if (inner)
+            inner->new_vars(n);
+    }
+
+    void add_clause(const vector<CMSat::Lit> &clause) override
+    {
+        if (!closed)
+            write(clause);
+        if (inner)
+            inner->add_clause(clause);
+    }
+
+    bool okay() const override { return !inner || inner->okay(); }
+
+    void set_num_threads(unsigned n) override
+    {
+        if (inner)
+            inner->set_num_threads(n);
+    }
+
+    void set_timeout_all_calls(double s) override
+    {
+        if (inner)
+            inner->set_timeout_all_calls(s);
+    }
+
+    void set_max_confl(uint64_t budget) override
+    {
+        if (inner)
+            inner->set_max_confl(budget);
+    }
+
+    CMSat::lbool solve(const vector<CMSat::Lit> *assumptions) override
+    {
+        if (incremental)
+        {
+            out << 'a';
+            if (assumptions)
+                for (auto l : *assumptions)
+                {
+                    out << ' ';
+                    write(l);
+                }
+            out << " 0\n";
+            out.flush();
+            stream.flush();
+        }
+        else if (!closed)
+        {
+            if (assumptions)
+                for (auto l : *assumptions)
+                    write(vector<CMSat::Lit>{l});
+            close();
+        }
+        return inner ? inner->solve(assumptions) : CMSat::l_Undef;
+    }
+
+    const vector<CMSat::lbool> &get_model() const override { return inner ? inner->get_model() : model; }
+    const vector<CMSat::Lit> &get_conflict() const override { return inner ? inner->get_conflict() : conflict; }
+
+    uint64_t get_sum_conflicts() override { return inner ? inner->get_sum_conflicts() : 0; }
+    uint64_t get_sum_decisions() override { return inner ? inner->get_sum_decisions() : 0; }
+    uint64_t get_sum_propagations() override { return inner ? inner->get_sum_propagations() : 0; }
+};
+
+inline std::unique_ptr<Backend> Backend::create(Engine engine, std::atomic<bool> *interrupt)
+{
+    switch (engine)
+    {
+#ifdef USE_IPASIR
+    case IPASIR:
+        return std::make_unique<Ipasir>(interrupt);
+#else
+    case IPASIR:
+        throw std::runtime_error("Built without an IPASIR solver");
+#endif
+    default:
+        return std::make_unique<CryptoMiniSat>(interrupt);
+    }
+}
+
 struct Config
 {
-    bool prep = true; // Calculate distances and add singleton clauses
+    bool prep = true; // Calculate distances, variables unreachable in time are never created
     double f = 2.0;   // Exponential search parameter
 
-    bool amo = true;        // Use sequential instead of binomial encoding
+    double horizon = 1.0; // Encode this multiple of the initial bound upfront
+
+    unsigned lift = 10000;  // Conflict budget for probing makespans on UNSAT cores (0 disables)
+    unsigned slice = 10000; // Conflicts per backend call of solvers which can be cancelled
+
+    enum Amo
+    {
+        BINOMIAL,
+        SEQUENTIAL,
+        COMMANDER,
+        PRODUCT,
+        BIMANDER,
+        AUTO, // The smallest of the above for each group size
+    };
+
+    Amo amo = SEQUENTIAL;   // Encoding of at-most-one constraints
     bool edge_vars = false; // Use designated agent transition variables
     bool move_vars = false; // Use designated move events
 
@@ -98,26 +507,50 @@ struct Config
     bool blocking_containers = true;
 
     unsigned n_threads = 4;
+    unsigned n_probes = 1; // Solvers probing makespans in parallel, with n_threads each
+    bool portfolio = false; // Race the encodings of Config(int) against each other
     int timeout_s = 600;
 
+    Backend::Engine backend = Backend::CRYPTOMINISAT;
+
     bool edge_reservation = true;
+    bool edge_traversal = false; // Prohibit swaps through a traversal variable per edge direction
     bool transport = true;
 
+    bool lazy = false; // Add edge reservation and container limit clauses on demand
+
     bool log = true;
+    Trace *trace = nullptr; // Receives the logged sequences of all solvers using this config
+    bool perf = false;      // Count instructions, cache and branch misses of encoding and solving
+    bool rss = true;        // Report the peak memory of the process, unless it is shared by instances
+
+    std::ostream *icnf = nullptr;    // Receives the formula and the assumptions of every query as iCNF
+    std::ostream *var_map = nullptr; // Receives variable, entity, vertex and time step of every position
+
+    const char *cache = nullptr; // Directory of encoded time steps, shared between runs of an instance
 
     constexpr Config() = default;
 
     constexpr Config(bool prep, double f) : prep(prep), f(f) {}
 
+    static constexpr int N_ENCODINGS = 6;
+
     explicit constexpr Config(int encoding)
     {
         switch (encoding)
         {
         case 0:
-            amo = false;
+            amo = BINOMIAL;
+            break;
+        case 4:
+            amo = AUTO;
+            break;
+        case 5:
+            edge_traversal = true;
             break;
         case 3:
             move_vars = true;
+            [[fallthrough]];
         case 2:
             edge_vars = true;
         }
@@ -130,15 +563,34 @@ struct Config
         ss << prep << sep << f;
         ss << sep << timeout_s << sep << n_threads;
         ss << sep << edge_reservation << sep << transport;
+        if (backend != Backend::CRYPTOMINISAT)
+            ss << sep << "ipasir";
+        if (edge_traversal)
+            ss << sep << "traversal";
         return ss.str();
     }
+
+    // A fingerprint without the number of threads, which depends on the machine rather
+    // than the encoding
+    static string identity(const string &fingerprint)
+    {
+        auto begin = fingerprint.find('|', fingerprint.find('|', fingerprint.find('|') + 1) + 1);
+        return fingerprint.substr(0, begin) + fingerprint.substr(fingerprint.find('|', begin + 1));
+    }
 };
 
 class Solver : public Problem
 {
     int T = -1;
 
-    CMSat::SATSolver solver;
+    std::atomic<bool> cancelled = false; // Interrupts the current query
+    std::atomic<bool> halted = false;    // Interrupts the search
+    bool shared = false;                 // Flags are set by other threads, see sat()
+    const Solver *owner = nullptr;       // Of a clone in a probe pool, halting it halts the clone
+
+    bool stopped() const { return halted || (owner && owner->stopped()); }
+
+    std::unique_ptr<Backend> solver;
 
     Config config;
 
@@ -148,7 +600,21 @@ class Solver : public Problem
 
 public:
     template <typename... Args>
-    Solver(Config config, Args... args) : Problem(args...), config(config) {}
+    Solver(Config config, Args... args)
+        : Problem(args...), solver(Backend::create(config.backend, &cancelled)), config(config)
+    {
+        logger.trace = config.trace;
+        if (config.icnf)
+            solver = std::make_unique<Export>(std::move(solver), *config.icnf, true);
+        if (config.var_map)
+            var_map.emplace(*config.var_map);
+    }
+
+    ~Solver()
+    {
+        if (cache)
+            cache->write(fresh);
+    }
 
 private:
     struct Var
@@ -163,49 +629,181 @@ private:
 
         int e, v, w, t, c, a;
 
-        static inline int aux = 0;
-
         Var(int e, int v, int t) : type(VERTEX), e(e), v(v), t(t) {}
         Var(int e, int v, int w, int t) : type(EDGE), e(e), v(v), w(w), t(t) {}
-        explicit Var(int a) : type(AUXILIARY), a(a) { aux = std::max(aux, a + 1); }
+        explicit Var(int a) : type(AUXILIARY), a(a) {}
         Var(int c, int a) : type(ASSIGNMENT), c(c), a(a) {}
+    };
+
+    // Every time step owns a contiguous block of variables: one per entity and vertex the
+    // entity can reach by then, followed by one per edge entity and directed edge leaving
+    // such a vertex (if edge variables are used). Unreachable variables are never created.
+    // Auxiliary variables are allocated in between and are identified by their index.
+    struct Layer
+    {
+        int vertex, edge, end;
+        vector<int> vertices; // First vertex variable per entity
+        vector<int> edges;    // First edge variable per edge entity
+    };
+
+    vector<Layer> layers;
+    int assignment = -1; // First assignment variable
+
+    optional<Writer> var_map; // Variables are numbered from 1 as in DIMACS
 
-        string to_string() const
+    // The vertices reachable by an entity at any time step form a prefix of its order
+    vector<vector<int>> order;
+    vector<vector<int>> rank;    // Position of each vertex in order, -1 if unreachable
+    vector<vector<int>> degrees; // Cumulative degrees along order, per edge entity
+
+    // Entities with edge variables
+    range edged() const { return config.transport ? A : C_u_A; }
+
+    // Earliest time step at which an entity may occupy a vertex
+    int reach(int e, int v) const
+    {
+        if (!config.prep)
+            return 0;
+        return dist[e][v] != Distances::none ? dist[e][v] : std::numeric_limits<int>::max();
+    }
+
+    void init_order()
+    {
+        order.resize(C_u_A.size());
+        rank.resize(C_u_A.size(), vector<int>(V.size(), -1));
+        for (auto e : C_u_A)
         {
-            std::stringstream ss;
-            static const auto sep = ",";
-            if (type == AUXILIARY)
-                ss << a;
-            else if (type == ASSIGNMENT)
-                ss << c << sep << a;
-            else
-            {
-                ss << e << sep << v << sep << t;
-                if (type == EDGE)
-                    ss << sep << w;
-            }
-            return ss.str();
+            for (auto v : V)
+                if (reach(e, v) < std::numeric_limits<int>::max())
+                    order[e].push_back(v);
+            std::stable_sort(order[e].begin(), order[e].end(), [&](int v, int w)
+                             { return reach(e, v) < reach(e, w); });
+            for (int i : range(order[e]))
+                rank[e][order[e][i]] = i;
         }
-    };
+        for (auto e : edged())
+        {
+            vector<int> d({0});
+            for (auto v : order[e])
+                d.push_back(d.back() + adj[v].size());
+            degrees.push_back(std::move(d));
+        }
+    }
 
-    std::unordered_map<string, int> vars;
-    vector<Var> srav;
-
-    // This is not very fast but flexible
-    int to_cms(Var var)
-    {
-        auto vs = var.to_string();
-        auto it = vars.find(vs);
-        if (it != vars.end())
-            return it->second;
-        int ret = srav.size();
-        vars.insert({vs, ret});
-        srav.push_back(var);
-        if (auto nvars = solver.nVars(); nvars < srav.size())
-            solver.new_vars(std::max(nvars, 1u));
+    int aux(int n)
+    {
+        int ret = solver->nVars();
+        if (family >= 0)
+            stats.by_family[family].n_aux += n;
+        if (in_amo)
+            stats.by_family[Stats::AMO].n_aux += n;
+        if (n)
+            solver->new_vars(n);
         return ret;
     }
 
+    void allocate_layer()
+    {
+        int t = layers.size();
+        Layer l;
+        l.vertex = solver->nVars();
+        l.vertices.push_back(l.vertex);
+        for (auto e : C_u_A)
+        {
+            int n = t ? layers.back().vertices[e + 1] - layers.back().vertices[e] : 0;
+            while (n < static_cast<int>(order[e].size()) && reach(e, order[e][n]) <= t)
+                ++n;
+            l.vertices.push_back(l.vertices.back() + n);
+        }
+        l.edge = l.end = l.vertices.back();
+        if (config.edge_vars)
+        {
+            l.edges.push_back(l.edge);
+            for (auto e : edged())
+                l.edges.push_back(l.edges.back() + degrees[e - *edged().begin()][l.vertices[e + 1] - l.vertices[e]]);
+            l.end = l.edges.back();
+        }
+        if (var_map)
+            for (auto e : C_u_A)
+                for (int i : range(0, l.vertices[e + 1] - l.vertices[e]))
+                    *var_map << l.vertices[e] + i + 1 << ' ' << e << ' ' << order[e][i] << ' ' << t << '\n';
+        layers.push_back(std::move(l));
+        aux(layers.back().end - layers.back().vertex);
+    }
+
+    void allocate_assignment()
+    {
+        assignment = aux(C.size() * A.size());
+    }
+
+    // Returns -1 for variables which are known to be false
+    int to_cms(const Var &var) const
+    {
+        switch (var.type)
+        {
+        case Var::VERTEX:
+        {
+            assert(var.t < static_cast<int>(layers.size()));
+            auto &l = layers[var.t];
+            int r = rank[var.e][var.v];
+            if (r < 0 || l.vertices[var.e] + r >= l.vertices[var.e + 1])
+                return -1;
+            return l.vertices[var.e] + r;
+        }
+        case Var::EDGE:
+        {
+            assert(var.t < static_cast<int>(layers.size()));
+            auto &l = layers[var.t];
+            int r = rank[var.e][var.v];
+            if (r < 0 || l.vertices[var.e] + r >= l.vertices[var.e + 1])
+                return -1;
+            int i = var.e - *edged().begin();
+            int j = adj.id(var.v, var.w);
+            assert(j >= 0);
+            return l.edges[i] + degrees[i][r] + j - adj.offsets[var.v];
+        }
+        case Var::ASSIGNMENT:
+            assert(assignment >= 0);
+            return assignment + var.c * A.size() + var.a - *A.begin();
+        default:
+            return var.a;
+        }
+    }
+
+    bool alive(const Var &var) const { return to_cms(var) >= 0; }
+
+    // Number of vertices an entity can reach by time step t
+    int reachable(int e, int t) const { return layers[t].vertices[e + 1] - layers[t].vertices[e]; }
+
+    // Reverse map for solution extraction, O(log T + log |V|)
+    Var srav(int i) const
+    {
+        auto it = std::upper_bound(layers.begin(), layers.end(), i,
+                                   [](int i, const Layer &l)
+                                   { return i < l.vertex; });
+        if (it != layers.begin())
+        {
+            auto &l = *--it;
+            int t = it - layers.begin();
+            if (i < l.edge)
+            {
+                int e = std::upper_bound(l.vertices.begin(), l.vertices.end(), i) - l.vertices.begin() - 1;
+                return Var(e, order[e][i - l.vertices[e]], t);
+            }
+            if (i < l.end)
+            {
+                int j = std::upper_bound(l.edges.begin(), l.edges.end(), i) - l.edges.begin() - 1;
+                auto &d = degrees[j];
+                int r = std::upper_bound(d.begin(), d.end(), i - l.edges[j]) - d.begin() - 1;
+                int e = *edged().begin() + j, v = order[e][r];
+                return Var(e, v, adj[v][i - l.edges[j] - d[r]], t);
+            }
+        }
+        if (assignment >= 0 && range(assignment, assignment + C.size() * A.size()).contains(i))
+            return Var((i - assignment) / A.size(), *A.begin() + (i - assignment) % A.size());
+        return Var(i);
+    }
+
     struct Lit : public Var
     {
         bool positive = true;
@@ -218,158 +816,794 @@ private:
             ret.positive = !positive;
             return ret;
         }
+    };
+
+    // Clauses are written to a flat arena and handed to the solver in batches
+    vector<CMSat::Lit> arena;
+    vector<int> bounds = {0};  // Clause i occupies arena[bounds[i], bounds[i + 1])
+    vector<CMSat::Lit> buffer; // Reused for passing a clause on
+
+    static constexpr int batch_size = 1 << 16; // Literals
+
+    // Clauses, literals, auxiliary variables and time are attributed to the constraint
+    // family being encoded, see Stats::Family
+    int family = -1;
+    bool in_amo = false;
+    std::chrono::steady_clock::time_point since;
+
+    void charge(int f)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (family >= 0)
+            stats.by_family[family].t += (now - since).count();
+        since = now;
+        family = f;
+    }
+
+    struct Family
+    {
+        Solver &s;
+        int previous;
+
+        Family(Solver &s, int f) : s(s), previous(s.family) { s.charge(f); }
+        ~Family() { s.charge(previous); }
+    };
+
+    // Hardware counters are charged to the phase being run, like families
+    enum
+    {
+        EXTEND,
+        SOLVER,
+    };
+
+    optional<Perf> perf;
+    int phase = -1;
+    Perf::Sample last;
+
+    void init_perf()
+    {
+        if (!config.perf)
+            return;
+        perf.emplace();
+        last = Perf::Sample();
+        if (!perf->available())
+        {
+            perf.reset();
+            logger.put("Hardware counters unavailable\n");
+        }
+    }
+
+    void enter(int p)
+    {
+        if (perf)
+        {
+            auto now = perf->read();
+            if (phase >= 0)
+                (phase == EXTEND ? stats.hw_extend : stats.hw_solver) += now - last;
+            last = now;
+        }
+        phase = p;
+    }
 
-        static inline Solver *s;
+    struct Phase
+    {
+        Solver &s;
+        int previous;
 
-        operator CMSat::Lit() const { return CMSat::Lit(s->to_cms(*this), !positive); }
+        Phase(Solver &s, int p) : s(s), previous(s.phase) { s.enter(p); }
+        ~Phase() { s.enter(previous); }
     };
 
-    void add_clause(vector<CMSat::Lit> &&clause)
+    // Time spent by the solver on clauses of the encoding is not accounted to it
+    void flush(bool encoding = true)
+    {
+        if (bounds.size() == 1)
+            return;
+        Family none(*this, -1);
+        Phase p(*this, SOLVER);
+        logger.start_sequence("", "flush");
+        for (int i : range(1, bounds.size()))
+        {
+            buffer.assign(arena.begin() + bounds[i - 1], arena.begin() + bounds[i]);
+            solver->add_clause(buffer);
+        }
+        auto diff = logger.end_sequence();
+        if (encoding)
+            stats.t_extend -= diff;
+        stats.t_solver += diff;
+        arena.clear();
+        bounds.resize(1);
+
+        assert(solver->okay());
+    }
+
+    // Completes the clause at the end of the arena
+    void add_clause(int f)
     {
+        if (recording)
+            record(step, layers[T].end, bounds.back(), f);
+        if (caching)
+            record(*caching, caching_aux, bounds.back(), f);
+
+        int n = arena.size() - bounds.back();
         ++stats.n_clauses;
-        stats.n_literals += clause.size();
-        stats.n_variables = vars.size();
+        stats.n_literals += n;
+        stats.n_variables = solver->nVars();
+        if (f >= 0)
+        {
+            ++stats.by_family[f].n_clauses;
+            stats.by_family[f].n_literals += n;
+        }
+        if (in_amo)
+        {
+            ++stats.by_family[Stats::AMO].n_clauses;
+            stats.by_family[Stats::AMO].n_literals += n;
+        }
 
         if (stats.n_literals > max_literals)
             throw maximum_makespan_e(stats);
 
-        logger.start_sequence();
-        solver.add_clause(clause);
-        auto diff = logger.end_sequence();
-        stats.t_extend -= diff;
-        stats.t_solver += diff;
+        bounds.push_back(arena.size());
+        if (static_cast<int>(arena.size()) >= batch_size)
+            flush();
+    }
+
+    template <class T = std::initializer_list<Lit>>
+    void add(T &&literals)
+    {
+        int begin = arena.size();
+        for (const Lit &l : literals)
+        {
+            int i = to_cms(l);
+            if (i >= 0)
+                arena.emplace_back(i, !l.positive);
+            else if (!l.positive)
+            {
+                arena.resize(begin);
+                return; // Trivially satisfied
+            }
+        }
+        assert(static_cast<int>(arena.size()) > begin);
+        add_clause(family);
+    }
+
+    vector<CMSat::lbool> model; // Of the last satisfiable query
 
-        assert(solver.okay());
+    // Assumptions querying makespan t over the encoded horizon
+    vector<CMSat::Lit> destination(int t)
+    {
+        vector<CMSat::Lit> ret;
+        for (auto c : C)
+            ret.emplace_back(done[c][t], false);
+        return ret;
+    }
+
+    // CryptoMiniSat does not expose its number of restarts
+    void gather()
+    {
+        stats.n_conflicts = solver->get_sum_conflicts();
+        stats.n_decisions = solver->get_sum_decisions();
+        stats.n_propagations = solver->get_sum_propagations();
+
+        rusage usage;
+        if (config.rss && !getrusage(RUSAGE_SELF, &usage))
+            stats.kb_peak_rss = usage.ru_maxrss;
+
+        size_t bytes = heap_size(order) + heap_size(rank) + heap_size(degrees);
+        bytes += heap_size(done) + heap_size(by_goal) + heap_size(by_start) + heap_size(model);
+        bytes += heap_size(step.shape) + heap_size(step.clauses) + heap_size(step.families);
+        bytes += heap_size(arena) + heap_size(bounds) + heap_size(buffer) + heap_size(layers);
+        for (auto &l : layers)
+            bytes += heap_size(l.vertices) + heap_size(l.edges);
+        stats.kb_tables = bytes / 1024;
+    }
+
+    // A conflict budget makes the call return l_Undef once exhausted instead of timing out.
+    // The backend may clear its interrupt flag when a call starts, losing a cancellation
+    // which arrives just before. A shared solver thus solves in slices of conflicts and
+    // checks its flags in between.
+    CMSat::lbool sat(const vector<CMSat::Lit> &assumptions, unsigned budget = 0)
+    {
+        if (stopped())
+            throw interrupted_e(stats);
+        if (cancelled)
+            return CMSat::l_Undef;
+        flush(false);
+        if (var_map)
+            var_map->flush();
+        auto now = logger.start_sequence("", "sat");
+        if (max_time < now)
+            throw timeout_e(stats);
+
+        const auto unlimited = std::numeric_limits<uint64_t>::max();
+        uint64_t slice = shared && config.slice ? config.slice : unlimited, left = budget ? budget : unlimited;
+        CMSat::lbool res = CMSat::l_Undef;
+        {
+            Phase p(*this, SOLVER);
+            while (left && !cancelled && !stopped() && now <= max_time)
+            {
+                solver->set_timeout_all_calls(static_cast<long double>((max_time - now).count()) / 1e9L);
+                if (std::min(slice, left) < unlimited)
+                    solver->set_max_confl(std::min(slice, left));
+                auto n = solver->get_sum_conflicts();
+                res = solver->solve(&assumptions);
+                if (res != CMSat::l_Undef || slice == unlimited)
+                    break;
+                left -= std::min(left, solver->get_sum_conflicts() - n);
+                now = std::chrono::steady_clock::now();
+            }
+        }
+        if (budget || slice < unlimited)
+            solver->set_max_confl(unlimited);
+        stats.t_solver += logger.end_sequence();
+        gather();
+
+        if (stopped())
+            throw interrupted_e(stats);
+        if (res == CMSat::l_Undef && !cancelled && (!budget || max_time < std::chrono::steady_clock::now()))
+            throw timeout_e(stats);
+        return res;
+    }
+
+    // Containers whose assumptions take part in the refutation of makespan t
+    vector<int> core(int t) const
+    {
+        vector<int> ret;
+        for (auto l : solver->get_conflict())
+            for (auto c : C)
+                if (done[c][t] == static_cast<int>(l.var()))
+                    ret.push_back(c);
+        return ret;
+    }
+
+    // Refuting makespan t for a subset of the containers refutes it for all of them. While
+    // the core of the last refutation is a proper subset, the following makespans are
+    // probed for the core containers only, with a limited number of conflicts.
+    void lift(int t)
+    {
+        auto S = core(t);
+        while (!cancelled && S.size() < C.size() && t < max_T && (stats.upper_bound < 0 || t + 1 < stats.upper_bound))
+        {
+            ++t;
+            logger.start_sequence("", "extend");
+            extend(t);
+            stats.t_extend += logger.end_sequence();
+            vector<CMSat::Lit> d;
+            for (auto c : S)
+                d.emplace_back(done[c][t], false);
+            if (sat(d, config.lift) != CMSat::l_False)
+                return;
+            stats.lower_bound = t + 1;
+            ++stats.n_lifted;
+            S = core(t);
+        }
+    }
+
+    // Adds the edge reservation and container limit clauses violated by the current
+    // model up to time step t. Returns whether any clause was added.
+    bool refine(int t)
+    {
+        Phase p(*this, EXTEND);
+        Family f(*this, Stats::LAZY);
+        auto &m = solver->get_model();
+        vector<vector<int>> paths(C_u_A.size(), vector<int>(t + 1, -1));
+        for (auto e : C_u_A)
+            for (auto u : range(t + 1))
+                for (int i : range(0, reachable(e, u)))
+                    if (m[to_cms(Var(e, order[e][i], u))] == CMSat::l_True)
+                        paths[e][u] = order[e][i];
+
+        int n = stats.n_clauses;
+        const auto &R = config.transport ? A : C_u_A;
+        vector<vector<int>> moves(adj.heads.size()); // Entities per directed edge
+        vector<int> used;
+        for (auto u : range(t))
+        {
+            for (auto e : C_u_A)
+                if (paths[e][u] != paths[e][u + 1])
+                {
+                    int i = adj.id(paths[e][u], paths[e][u + 1]);
+                    if (moves[i].empty())
+                        used.push_back(i);
+                    moves[i].push_back(e);
+                }
+            std::sort(used.begin(), used.end());
+            for (auto i : used)
+            {
+                auto &movers = moves[i];
+                int v = paths[movers[0]][u], w = adj.heads[i];
+                if (config.edge_reservation && v < w && reverse[i] >= 0)
+                    for (auto a : movers)
+                        for (auto b : moves[reverse[i]])
+                            if (a != b && R.contains(a) && R.contains(b))
+                                add({!Lit(a, v, u), !Lit(a, w, u + 1), !Lit(b, w, u), !Lit(b, v, u + 1)});
+                if (config.transport)
+                    for (auto c : movers)
+                        for (auto d : movers)
+                            if (c < d && C.contains(c) && C.contains(d))
+                                add({!Lit(c, v, u), !Lit(c, w, u + 1), !Lit(d, v, u), !Lit(d, w, u + 1)});
+            }
+            for (auto i : used)
+                moves[i].clear();
+            used.clear();
+        }
+        stats.n_lazy += stats.n_clauses - n;
+        return stats.n_clauses > n;
+    }
+
+    // Returns l_Undef if cancelled, which is also checked between layers
+    CMSat::lbool query_(int t)
+    {
+        if (t > max_T)
+            throw maximum_makespan_e(stats);
+
+        logger.start_sequence("Solving t = " + std::to_string(t));
+
+        logger.start_sequence("", "extend");
+        while (T < t && !cancelled)
+            extend(T + 1);
+        if (T < t)
+        {
+            stats.t_extend += logger.end_sequence();
+            logger.end_sequence();
+            return CMSat::l_Undef;
+        }
+        auto d = destination(t);
+        stats.t_extend += logger.end_sequence();
+        logger.put(" ...");
+
+        auto res = sat(d);
+        while (config.lazy && res == CMSat::l_True)
+        {
+            logger.start_sequence("", "refine");
+            bool refined = refine(t);
+            stats.t_extend += logger.end_sequence();
+            if (!refined)
+                break;
+            res = sat(d);
+        }
+
+        logger.end_sequence("\b\b\b");
+
+        if (res == CMSat::l_True)
+        {
+            model = solver->get_model();
+            stats.upper_bound = t;
+        }
+        else if (res == CMSat::l_False)
+        {
+            stats.lower_bound = t + 1;
+            if (config.lift)
+            {
+                logger.start_sequence("", "lift");
+                lift(t);
+                logger.end_sequence();
+            }
+        }
+        return res;
+    }
+
+    // Queries are recorded in the timeline of the stats, including the lifting that
+    // follows a refutation
+    CMSat::lbool query(int t)
+    {
+        using namespace std::chrono;
+        Stats::Query q;
+        q.t = t;
+        q.solver = id;
+        auto now = steady_clock::now();
+        q.t_start = (now - start).count();
+        q.t_extend = stats.t_extend, q.t_solver = stats.t_solver;
+        q.n_clauses = stats.n_clauses, q.n_variables = solver->nVars(), q.n_lifted = stats.n_lifted;
+        q.n_conflicts = solver->get_sum_conflicts(), q.n_decisions = solver->get_sum_decisions();
+        q.n_propagations = solver->get_sum_propagations();
+
+        auto finish = [&](Stats &s, string result)
+        {
+            q.result = result;
+            q.t_total = (steady_clock::now() - now).count();
+            q.t_extend = stats.t_extend - q.t_extend, q.t_solver = stats.t_solver - q.t_solver;
+            q.n_clauses = stats.n_clauses - q.n_clauses, q.n_variables = solver->nVars() - q.n_variables;
+            q.n_lifted = stats.n_lifted - q.n_lifted;
+            q.n_conflicts = solver->get_sum_conflicts() - q.n_conflicts;
+            q.n_decisions = solver->get_sum_decisions() - q.n_decisions;
+            q.n_propagations = solver->get_sum_propagations() - q.n_propagations;
+            s.queries.push_back(q);
+        };
+
+        try
+        {
+            auto res = query_(t);
+            finish(stats, res == CMSat::l_True ? "SAT" : res == CMSat::l_False ? "UNSAT" : "Cancelled");
+            return res;
+        }
+        catch (partially_solved &e)
+        {
+            finish(e.stats, e.what());
+            throw;
+        }
+    }
+
+    bool solve(int t)
+    {
+        auto res = query(t);
+        assert(res != CMSat::l_Undef);
+        return res == CMSat::l_True;
+    }
+
+    std::chrono::steady_clock::time_point start, max_time;
+    int id = 0; // Position in the pool of probing solvers
+
+    void encode(int l)
+    {
+        Phase p(*this, EXTEND);
+        if (config.cache)
+            cache = std::make_unique<Cache>(config.cache, cache_key());
+        init_order();
+        init_horizon();
+        allocate_layer();
+        allocate_assignment();
+        origin();
+        if (config.fixed_agent)
+            fixed_agent();
+        if (config.fixed_container)
+            fixed_container();
+        extend(std::max(l, static_cast<int>(ceil(l * config.horizon))));
+    }
+
+    // Exponential search followed by binary search
+    int search(int l, Paths &paths)
+    {
+        int t = l;
+        while (!solve(t))
+        {
+            l = stats.lower_bound - 1; // Strictly lower
+            t = std::max({static_cast<int>(ceil(t * config.f)), stats.lower_bound, 1});
+        }
+        int r = t;
+        while (l + 1 < r)
+        {
+            int m = (l + r) / 2;
+            if (solve(m))
+                r = m;
+            else
+                l = stats.lower_bound - 1;
+        }
+        paths = extract(r);
+        return r;
     }
 
-    template <class T = std::initializer_list<Lit>>
-    void add(T &&literals)
+    // Makespans are probed concurrently by a pool of solvers, each with an encoding of its
+    // own. Without an upper bound, probes are spread geometrically above the lower bound,
+    // otherwise they split the largest unprobed interval. A satisfiable probe cancels all
+    // probes above it and a refuted probe cancels all probes below it.
+    int probe(int l, Paths &paths)
     {
-        vector<CMSat::Lit> clause;
-        for (Lit l : literals)
-            clause.push_back(l);
-        add_clause(std::move(clause));
-    }
+        vector<std::unique_ptr<Solver>> clones;
+        vector<Solver *> pool({this});
+        for (_ : range(config.n_probes - 1))
+        {
+            clones.push_back(std::make_unique<Solver>(config, static_cast<const Problem &>(*this)));
+            clones.back()->logger.log = false;
+            clones.back()->start = start;
+            clones.back()->max_time = max_time;
+            clones.back()->id = clones.size();
+            clones.back()->owner = this;
+            clones.back()->stats.lower_bound = l;
+            pool.push_back(clones.back().get());
+        }
+        logger.log = false;
+        Logger progress(config.log);
+
+        std::mutex mutex;
+        std::condition_variable changed;
+        int lo = l, hi = -1;
+        vector<int> probing(pool.size(), -1);
+        std::exception_ptr error;
+        Solver *best = nullptr;
+        for (auto s : pool)
+            s->shared = true;
+
+        auto finished = [&]
+        { return lo == hi || error; };
+        auto pick = [&]() -> int
+        {
+            auto busy = [&](int t)
+            { return std::find(probing.begin(), probing.end(), t) != probing.end(); };
+            if (hi < 0)
+            {
+                double x = lo;
+                for (int t = lo;; t = std::max(t + 1, static_cast<int>(ceil(x *= sqrt(config.f)))))
+                    if (!busy(t))
+                        return t;
+            }
+            vector<int> points({lo - 1, hi});
+            for (auto t : probing)
+                if (lo <= t && t < hi)
+                    points.push_back(t);
+            std::sort(points.begin(), points.end());
+            int gap = 1, ret = -1;
+            for (int i : range(1, points.size()))
+                if (points[i] - points[i - 1] > gap)
+                {
+                    gap = points[i] - points[i - 1];
+                    ret = (points[i] + points[i - 1] + 1) / 2;
+                }
+            return ret;
+        };
+        // Once finished, solvers still encoding are cancelled too
+        auto cancel = [&]
+        {
+            for (int i : range(pool))
+                if (finished() || (probing[i] >= 0 && (probing[i] < lo || (hi >= 0 && probing[i] >= hi))))
+                    pool[i]->cancelled = true;
+        };
 
-    const vector<CMSat::lbool> *model;
+        auto work = [&](int i)
+        {
+            Solver *s = pool[i];
+            try
+            {
+                if (s != this)
+                {
+                    s->init_perf();
+                    s->solver->set_num_threads(config.n_threads);
+                    s->encode(l);
+                }
+                std::unique_lock<std::mutex> lock(mutex);
+                while (true)
+                {
+                    int t = -1;
+                    changed.wait(lock, [&]
+                                 { return finished() || (t = pick()) >= 0; });
+                    if (finished())
+                        return;
+                    probing[i] = t;
+                    s->cancelled = false;
+                    s->stats.upper_bound = hi;
+                    lock.unlock();
+
+                    auto res = s->query(t);
+
+                    lock.lock();
+                    probing[i] = -1;
+                    if (res == CMSat::l_True && (hi < 0 || t < hi))
+                    {
+                        hi = t;
+                        best = s;
+                    }
+                    if (res == CMSat::l_False)
+                        lo = std::max(lo, s->stats.lower_bound);
+                    if (res != CMSat::l_Undef)
+                        progress.put("Probed t = " + std::to_string(t) + (res == CMSat::l_True ? ": SAT\n" : ": UNSAT\n"));
+                    cancel();
+                    changed.notify_all();
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error)
+                    error = std::current_exception();
+                for (auto s : pool)
+                    s->cancelled = true;
+                changed.notify_all();
+            }
+        };
+
+        // Threads inherit the counters open when they are spawned. Each clone counts its own
+        // thread, so the counters of this solver are closed while the pool is spawned.
+        enter(phase);
+        perf.reset();
+        vector<std::thread> threads;
+        for (int i : range(1, pool.size()))
+            threads.emplace_back(work, i);
+        init_perf();
+        work(0);
+        for (auto &t : threads)
+            t.join();
+        logger.log = config.log;
 
-    vector<CMSat::Lit> destination(int t)
-    {
-        vector<CMSat::Lit> ret;
-        for (auto c : C)
-            ret.push_back(Lit(c, g[c], t));
-        return ret;
+        for (auto &clone : clones)
+        {
+            stats.t_extend += clone->stats.t_extend;
+            stats.t_solver += clone->stats.t_solver;
+            stats.n_clauses += clone->stats.n_clauses;
+            stats.n_variables += clone->stats.n_variables;
+            stats.n_literals += clone->stats.n_literals;
+            stats.n_lazy += clone->stats.n_lazy;
+            stats.n_lifted += clone->stats.n_lifted;
+            stats.n_cached += clone->stats.n_cached;
+            for (int i : range(Stats::N_FAMILIES))
+                stats.by_family[i] += clone->stats.by_family[i];
+            stats.queries.insert(stats.queries.end(), clone->stats.queries.begin(), clone->stats.queries.end());
+            stats.n_conflicts += clone->stats.n_conflicts;
+            stats.n_decisions += clone->stats.n_decisions;
+            stats.n_propagations += clone->stats.n_propagations;
+            stats.kb_peak_rss = std::max(stats.kb_peak_rss, clone->stats.kb_peak_rss);
+            stats.kb_tables += clone->stats.kb_tables;
+            stats.hw_extend += clone->stats.hw_extend;
+            stats.hw_solver += clone->stats.hw_solver;
+        }
+        std::sort(stats.queries.begin(), stats.queries.end(), [](const Stats::Query &a, const Stats::Query &b)
+                  { return a.t_start < b.t_start; });
+        stats.lower_bound = lo;
+        stats.upper_bound = hi;
+        if (error)
+            std::rethrow_exception(error);
+        paths = best->extract(hi);
+        return hi;
     }
 
-    bool solve(int t)
+    Paths extract(int r) const
     {
-        if (t > max_T)
-            throw maximum_makespan_e(stats);
-
-        logger.start_sequence("Solving t = " + std::to_string(t));
-
-        logger.start_sequence();
-        extend(t);
-        auto d = destination(t);
-        stats.t_extend += logger.end_sequence();
-        logger.put(" ...");
-
-        auto timeout = max_time - logger.start_sequence();
-        if (timeout.count() < 0)
-            throw timeout_e(stats);
-        solver.set_timeout_all_calls(static_cast<long double>(timeout.count()) / 1e9L);
-
-        auto res = solver.solve(&d);
-        stats.t_solver += logger.end_sequence();
+        Paths paths(C_u_A.size(), vector<int>(r + 1));
+        for (auto l : range(model))
+        {
+            if (model.at(l) != CMSat::l_True)
+                continue;
+            auto v = srav(l);
+            if (v.type != Var::VERTEX)
+                continue;
+            if (v.t > r)
+                continue;
+            paths.at(v.e).at(v.t) = v.v;
+        }
+        return paths;
+    }
 
-        if (res == CMSat::l_Undef)
-            throw timeout_e(stats);
+    // Runs the search with each of the encodings of Config(int) concurrently, except those
+    // which do not apply or coincide with another one. The first one to find the optimum
+    // halts the others.
+    Solution portfolio()
+    {
+        vector<std::unique_ptr<Solver>> members;
+        vector<int> encodings;
+        for (int e : range(Config::N_ENCODINGS))
+        {
+            Config c(e);
+            // Edge variables do not limit transports to one container per edge
+            if ((c.edge_vars || c.move_vars) && (config.fixed_agent || config.fixed_container || config.lazy || !config.blocking_containers))
+                continue;
+            // Traversal variables replace eager edge reservation only
+            if (c.edge_traversal && (config.lazy || !config.edge_reservation))
+                continue;
+            Config member = config;
+            member.amo = c.amo;
+            member.edge_vars = c.edge_vars;
+            member.move_vars = c.move_vars;
+            member.edge_traversal = c.edge_traversal;
+            member.portfolio = false;
+            member.log = false;
+            members.push_back(std::make_unique<Solver>(member, static_cast<const Problem &>(*this)));
+            members.back()->shared = true;
+            encodings.push_back(e);
+        }
 
-        logger.end_sequence("\b\b\b");
+        std::mutex mutex;
+        optional<Solution> result;
+        std::exception_ptr error;
 
-        if (res == CMSat::l_True)
+        auto run = [&](int i)
         {
-            model = &solver.get_model();
-            stats.upper_bound = t;
-            return true;
-        }
-        assert(res == CMSat::l_False);
-        stats.lower_bound = t + 1;
-        return false;
-    }
+            try
+            {
+                auto solution = members[i]->solve();
+                std::lock_guard<std::mutex> lock(mutex);
+                if (result)
+                    return;
+                result = solution;
+                result->stats.encoding = encodings[i];
+                // Halted before cancelled, so a member seeing the latter throws
+                for (auto &m : members)
+                {
+                    m->halted = true;
+                    m->cancelled = true;
+                }
+            }
+            catch (interrupted_e &)
+            {
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+        };
 
-    std::chrono::steady_clock::time_point max_time;
+        logger.log = config.log;
+        logger.start_sequence("Racing " + std::to_string(members.size()) + " encodings ");
+        vector<std::thread> threads;
+        for (int i : range(members))
+            threads.emplace_back(run, i);
+        for (auto &t : threads)
+            t.join();
+
+        if (!result)
+            std::rethrow_exception(error);
+        logger.end_sequence("Encoding " + std::to_string(result->stats.encoding) +
+                            " found optimal solution of length " + std::to_string(result->makespan) + " ");
+        return result.value();
+    }
 
 public:
     Solution solve()
     {
+        // A formula is exported by a single solver
+        if ((config.icnf || config.var_map) && (config.portfolio || config.n_probes > 1))
+            throw "Unsupported configuration";
+        if (config.portfolio)
+            return portfolio();
         if ((config.fixed_agent || config.fixed_container) && (config.edge_vars || config.move_vars))
             throw "Unsupported configuration";
+        if (config.lazy && config.edge_vars)
+            throw "Unsupported configuration";
         logger.log = config.log;
 
-        max_time = logger.start_sequence() + std::chrono::seconds(config.timeout_s);
+        start = logger.start_sequence("", "total");
+        max_time = start + std::chrono::seconds(config.timeout_s);
         logger.start_sequence("Initializing ");
 
-        Lit::s = this;
-        solver.set_num_threads(config.n_threads);
+        init_perf();
+        solver->set_num_threads(config.n_threads);
 
-        logger.start_sequence();
+        logger.start_sequence("", "bound");
         auto b = config.prep ? bound(config.transport) : 0;
+        if (config.prep)
+            backward();
         stats.t_bound = logger.end_sequence();
+        if (halted)
+            throw interrupted_e(stats);
 
         if (!b)
-            throw unsolvable;
+            throw unsolvable_e();
         int l = b.value();
         stats.lower_bound = stats.initial_bound = l;
 
         logger.put(" -");
 
-        logger.start_sequence();
-        origin();
-        if (config.fixed_agent)
-            fixed_agent();
-        if (config.fixed_container)
-            fixed_container();
-        extend(l);
+        logger.start_sequence("", "encode");
+        encode(l);
         stats.t_extend += logger.end_sequence();
 
         logger.end_sequence(" ");
 
-        int t = l;
-        while (!solve(t))
-        {
-            l = t; // Strictly lower
-            t = std::max(static_cast<int>(ceil(t * config.f)), 1);
-        }
-        int r = t;
-        while (l + 1 < r)
-        {
-            int m = (l + r) / 2;
-            if (solve(m))
-                r = m;
-            else
-                l = m;
-        }
+        Paths paths;
+        int r = config.n_probes > 1 ? probe(l, paths) : search(l, paths);
         stats.t_total = logger.end_sequence(
             "Found optimal solution of length " + std::to_string(r) + " ");
 
-        vector<vector<int>> paths(C_u_A.size(), vector<int>(r + 1));
-        for (auto l : range(*model))
-        {
-            if (model->at(l) != CMSat::l_True)
-                continue;
-            if (l >= static_cast<int>(srav.size()))
-                continue;
-            auto v = srav[l];
-            if (v.type != Var::VERTEX)
-                continue;
-            if (v.t > r)
-                continue;
-            paths.at(v.e).at(v.t) = v.v;
-        }
         return Solution(*this, r, paths, stats);
     }
 
+    // Writes the formula of makespan t as DIMACS instead of solving it. Clauses added on
+    // demand are missing from the formula, hence lazy encoding is not supported.
+    void dimacs(int t, std::ostream &out)
+    {
+        if (config.lazy)
+            throw "Unsupported configuration";
+        logger.log = false;
+        start = std::chrono::steady_clock::now();
+        max_time = std::chrono::steady_clock::time_point::max();
+        solver = std::make_unique<Export>(nullptr, out, false);
+
+        auto b = config.prep ? bound(config.transport) : 0;
+        if (config.prep)
+            backward();
+        if (!b)
+            throw unsolvable_e();
+        if (t > max_T)
+            throw maximum_makespan_e(stats);
+        encode(std::min(b.value(), t));
+        extend(t);
+        flush(false);
+        if (var_map)
+            var_map->flush();
+        auto d = destination(t);
+        solver->solve(&d);
+    }
+
 private:
     // O(|vars|^2)
     void inline amo_binomial(const vector<Lit> &vars)
@@ -383,7 +1617,7 @@ private:
     // O(|vars|) with |vars| auxilary variables
     void inline amo_sequential(const vector<Lit> &vars)
     {
-        int r = Var::aux;
+        int r = aux(vars.size());
         for (int i : range(vars))
         {
             add({!vars[i], Lit(r + i)});
@@ -395,16 +1629,188 @@ private:
         }
     }
 
-    void amo(const vector<Lit> &vars)
+    // O(|vars|^2), every pair once
+    void inline amo_pairwise(const vector<Lit> &vars)
     {
-        if (config.amo)
-            amo_sequential(vars);
-        else
+        for (int i : range(vars))
+            for (int j : range(i + 1, vars.size()))
+                add({!vars[i], !vars[j]});
+    }
+
+    // Groups below this size are encoded pairwise by the recursive encodings
+    static constexpr int amo_small = 5;
+
+    // O(|vars|) with about |vars| / 2 auxiliary variables: each group of three implies its
+    // commander, the commanders are at most one recursively
+    void amo_commander(const vector<Lit> &vars)
+    {
+        int n = vars.size();
+        if (n < amo_small)
+            return amo_pairwise(vars);
+        int r = aux((n + 2) / 3);
+        vector<Lit> commanders;
+        for (int i = 0; i < n; i += 3)
+        {
+            Lit c(r + i / 3);
+            vector<Lit> group(vars.begin() + i, vars.begin() + std::min(i + 3, n));
+            amo_pairwise(group);
+            for (auto &l : group)
+                add({!l, c});
+            commanders.push_back(c);
+        }
+        amo_commander(commanders);
+    }
+
+    // O(|vars|) with about 2 sqrt(|vars|) auxiliary variables: vars are laid out in a grid
+    // and imply their row and column, which are at most one recursively
+    void amo_product(const vector<Lit> &vars)
+    {
+        int n = vars.size();
+        if (n < amo_small)
+            return amo_pairwise(vars);
+        int q = ceil(sqrt(n)), p = (n + q - 1) / q;
+        int r = aux(p + q);
+        vector<Lit> rows, columns;
+        for (int i : range(p))
+            rows.emplace_back(r + i);
+        for (int j : range(q))
+            columns.emplace_back(r + p + j);
+        for (int i : range(vars))
+        {
+            add({!vars[i], rows[i / q]});
+            add({!vars[i], columns[i % q]});
+        }
+        amo_product(rows);
+        amo_product(columns);
+    }
+
+    // O(|vars| log |vars|) with log |vars| auxiliary variables: pairs of vars are at most
+    // one and imply the binary code of their pair
+    void amo_bimander(const vector<Lit> &vars)
+    {
+        int n = vars.size();
+        if (n < amo_small)
+            return amo_pairwise(vars);
+        int bits = 0;
+        while ((1 << bits) < (n + 1) / 2)
+            ++bits;
+        int r = aux(bits);
+        for (int i : range(vars))
+        {
+            if (i % 2)
+                add({!vars[i - 1], !vars[i]});
+            for (int b : range(bits))
+                add({!vars[i], (i / 2 >> b & 1) ? Lit(r + b) : !Lit(r + b)});
+        }
+    }
+
+    // Clauses and auxiliary variables of an encoding for a group of n, all clauses binary
+    struct Size
+    {
+        long long n_clauses = 0, n_aux = 0;
+
+        Size &operator+=(const Size &o)
+        {
+            n_clauses += o.n_clauses;
+            n_aux += o.n_aux;
+            return *this;
+        }
+    };
+
+    static Size amo_size(Config::Amo amo, long long n)
+    {
+        if (amo != Config::BINOMIAL && amo != Config::SEQUENTIAL && n < amo_small)
+            return {n * (n - 1) / 2, 0};
+        Size ret;
+        switch (amo)
+        {
+        case Config::BINOMIAL:
+            return {n * (n - 1), 0};
+        case Config::SEQUENTIAL:
+            return {n ? 3 * n - 2 : 0, n};
+        case Config::COMMANDER:
+            ret = {n + n / 3 * 3 + (n % 3 == 2), (n + 2) / 3};
+            ret += amo_size(amo, (n + 2) / 3);
+            return ret;
+        case Config::PRODUCT:
+        {
+            long long q = ceil(sqrt(n)), p = (n + q - 1) / q;
+            ret = {2 * n, p + q};
+            ret += amo_size(amo, p);
+            ret += amo_size(amo, q);
+            return ret;
+        }
+        case Config::BIMANDER:
+        {
+            long long bits = 0;
+            while ((1 << bits) < (n + 1) / 2)
+                ++bits;
+            return {n / 2 + n * bits, bits};
+        }
+        default:
+            return {};
+        }
+    }
+
+    // Picks the encoding with the fewest literals and auxiliary variables for groups of n.
+    // The choice only depends on n and is made once per size.
+    Config::Amo amo_auto(int n)
+    {
+        if (n >= static_cast<int>(amo_choice.size()))
+            amo_choice.resize(n + 1, Config::AUTO);
+        auto &ret = amo_choice[n];
+        if (ret != Config::AUTO)
+            return ret;
+        long long best = std::numeric_limits<long long>::max();
+        for (auto amo : {Config::SEQUENTIAL, Config::COMMANDER, Config::PRODUCT, Config::BIMANDER})
+        {
+            auto size = amo_size(amo, n);
+            if (2 * size.n_clauses + size.n_aux < best)
+                best = 2 * size.n_clauses + size.n_aux, ret = amo;
+        }
+        return ret;
+    }
+
+    vector<Config::Amo> amo_choice; // Of AUTO by group size
+
+    // Variables known to be false are dropped, groups of at most one need no clauses
+    void amo(vector<Lit> &vars)
+    {
+        vars.erase(std::remove_if(vars.begin(), vars.end(), [&](const Lit &l)
+                                  { return !alive(l); }),
+                   vars.end());
+        if (vars.size() < 2)
+            return;
+        in_amo = true;
+        auto encoding = config.amo == Config::AUTO ? amo_auto(vars.size()) : config.amo;
+#ifndef NDEBUG
+        auto size = amo_size(encoding, vars.size());
+        size.n_clauses += stats.n_clauses, size.n_aux += solver->nVars();
+#endif
+        switch (encoding)
+        {
+        case Config::BINOMIAL:
             amo_binomial(vars);
+            break;
+        case Config::COMMANDER:
+            amo_commander(vars);
+            break;
+        case Config::PRODUCT:
+            amo_product(vars);
+            break;
+        case Config::BIMANDER:
+            amo_bimander(vars);
+            break;
+        default:
+            amo_sequential(vars);
+        }
+        assert(size.n_clauses == stats.n_clauses && size.n_aux == solver->nVars());
+        in_amo = false;
     }
 
     void edge_vars(int t)
     {
+        Family f(*this, Stats::EDGE_VARS);
         for (auto a : A)
             for (auto e : E)
             {
@@ -417,12 +1823,14 @@ private:
 
     void origin()
     {
+        Family f(*this, Stats::ORIGIN);
         for (auto e : C_u_A)
             add({Lit(e, s[e], 0)});
     }
 
     void fixed_agent()
     {
+        Family f(*this, Stats::ASSIGNMENT);
         for (auto c : C)
         {
             vector<Lit> vars;
@@ -434,6 +1842,7 @@ private:
 
     void fixed_container()
     {
+        Family f(*this, Stats::ASSIGNMENT);
         for (auto a : A)
         {
             vector<Lit> vars;
@@ -446,11 +1855,12 @@ private:
     // (|A| + |C|) amo(|V|)
     void uniqueness(int t)
     {
+        Family f(*this, Stats::UNIQUENESS);
         for (auto e : C_u_A)
         {
             vector<Lit> vars;
-            for (auto v : V)
-                vars.emplace_back(e, v, t);
+            for (int i : range(0, reachable(e, t)))
+                vars.emplace_back(e, order[e][i], t);
             amo(vars);
         }
     }
@@ -458,9 +1868,11 @@ private:
     // O(|A||V|) of size O(∆)
     void whereabouts(int t)
     {
+        Family f(*this, Stats::WHEREABOUTS);
         for (auto e : C_u_A)
-            for (auto v : V)
+            for (int i : range(0, reachable(e, t)))
             {
+                int v = order[e][i];
                 vector<Lit> clause({!Lit(e, v, t), Lit(e, v, t + 1)});
                 for (auto w : adj[v])
                     clause.emplace_back(e, w, t + 1);
@@ -471,6 +1883,7 @@ private:
     // |V| (amo(|A|) + amo(|C|))
     void vertex_reservation(int t)
     {
+        Family f(*this, Stats::VERTEX_RESERVATION);
         for (auto v : V)
         {
             vector<Lit> vars;
@@ -491,29 +1904,56 @@ private:
     void inline edge_reservation_(int t)
     {
         const auto &R = config.transport ? A : C_u_A;
-        std::set<pair<int, int>> seen;
-        for (auto e : E)
+        for (auto e : U)
         {
-            if (seen.count(swap(e)))
-                continue;
-            seen.insert(e);
+            vector<int> forth, back;
             for (auto a : R)
-                for (auto b : R)
+            {
+                if (alive(Var(a, e.first, t)) && alive(Var(a, e.second, t + 1)))
+                    forth.push_back(a);
+                if (alive(Var(a, e.second, t)) && alive(Var(a, e.first, t + 1)))
+                    back.push_back(a);
+            }
+            for (auto a : forth)
+                for (auto b : back)
                     if (a != b)
                         add({!Lit(a, e.first, t), !Lit(a, e.second, t + 1), !Lit(b, e.second, t), !Lit(b, e.first, t + 1)});
         }
     }
 
+    // |E||A| with 2|E| auxiliary variables: m_vw holds if some entity moves from v to w,
+    // and m_vw and m_wv exclude each other
+    void inline edge_reservation_tv(int t)
+    {
+        const auto &R = config.transport ? A : C_u_A;
+        for (auto e : U)
+        {
+            vector<int> forth, back;
+            for (auto a : R)
+            {
+                if (alive(Var(a, e.first, t)) && alive(Var(a, e.second, t + 1)))
+                    forth.push_back(a);
+                if (alive(Var(a, e.second, t)) && alive(Var(a, e.first, t + 1)))
+                    back.push_back(a);
+            }
+            if (forth.empty() || back.empty())
+                continue;
+            int r = aux(2);
+            Lit m(r), n(r + 1);
+            for (auto a : forth)
+                add({!Lit(a, e.first, t), !Lit(a, e.second, t + 1), m});
+            for (auto b : back)
+                add({!Lit(b, e.second, t), !Lit(b, e.first, t + 1), n});
+            add({!m, !n});
+        }
+    }
+
     // |E| amo(|A|)
     void inline edge_reservation_ev(int t)
     {
         const auto &R = config.transport ? A : C_u_A;
-        std::set<pair<int, int>> seen;
-        for (auto e : E)
+        for (auto e : U)
         {
-            if (seen.count(swap(e)))
-                continue;
-            seen.insert(e);
             vector<Lit> vars;
             for (auto a : R)
             {
@@ -526,8 +1966,13 @@ private:
 
     void edge_reservation(int t)
     {
+        Family f(*this, Stats::EDGE_RESERVATION);
         if (config.edge_vars)
             edge_reservation_ev(t);
+        else if (config.lazy)
+            return;
+        else if (config.edge_traversal)
+            edge_reservation_tv(t);
         else
             edge_reservation_(t);
     }
@@ -538,11 +1983,15 @@ private:
         for (auto c : C)
             for (auto e : E)
             {
+                if (!alive(Var(c, e.first, t)) || !alive(Var(c, e.second, t + 1)))
+                    continue;
                 vector<Lit> base({!Lit(c, e.first, t), !Lit(c, e.second, t + 1)});
                 vector<Lit> transported = base;
                 for (auto a : A)
                 {
                     transported.push_back(Lit(a, e.first, t));
+                    if (!alive(Var(a, e.first, t)))
+                        continue;
 
                     vector<Lit> transporting = base;
                     transporting.push_back(!Lit(a, e.first, t));
@@ -555,6 +2004,8 @@ private:
                     add(transporting);
                 }
                 add(transported);
+                if (config.lazy)
+                    continue;
                 for (auto d : C)
                 {
                     if (d == c)
@@ -584,10 +2035,9 @@ private:
     // |E|(|C| + |A|) with 2|E| auxiliary variables
     void inline transport_mv(int t)
     {
-        int aux = Var::aux;
         for (auto e : E)
         {
-            int moving = aux++, moved = aux++;
+            int moving = aux(2), moved = moving + 1;
             for (auto c : C)
                 add({!Lit(c, e.first, t), !Lit(c, e.second, t + 1), Lit(moving)});
             vector<Lit> clause({!Lit(moved)});
@@ -600,6 +2050,7 @@ private:
 
     void transport(int t)
     {
+        Family f(*this, Stats::TRANSPORT);
         if (config.edge_vars)
             if (config.move_vars)
                 transport_mv(t);
@@ -609,13 +2060,223 @@ private:
             transport_(t);
     }
 
+    // Clauses of a generic time step, recorded once two consecutive layers have the same
+    // shape and replayed for every later step whose layers have that shape as well.
+    // Literals are stored relative to the previous layer, the current layer or the
+    // auxiliary variables of the step, or as absolute indices.
+    struct Template
+    {
+        enum
+        {
+            PREVIOUS,
+            CURRENT,
+            AUXILIARY,
+            ABSOLUTE,
+        };
+
+        vector<int> shape;
+        vector<int> clauses;  // Length-prefixed, literals as offset << 3 | sign << 2 | segment
+        vector<int> families; // Of each clause, as (family + 1) << 1 | amo
+        int n_aux = 0;
+        std::array<int, Stats::N_FAMILIES> n_aux_by_family{};
+    } step;
+
+    bool recording = false;
+
+    vector<int> shape(int t) const
+    {
+        auto &l = layers[t];
+        vector<int> ret;
+        for (auto i : l.vertices)
+            ret.push_back(i - l.vertex);
+        for (auto i : l.edges)
+            ret.push_back(i - l.vertex);
+        ret.push_back(l.end - l.vertex);
+        return ret;
+    }
+
+    // Records the clause starting at the given arena position, with the auxiliary
+    // variables of the step starting at aux
+    void record(Template &into, int aux, int begin, int f)
+    {
+        auto &p = layers[T ? T - 1 : T], &c = layers[T];
+        into.families.push_back((f + 1) << 1 | in_amo);
+        into.clauses.push_back(arena.size() - begin);
+        for (int i : range(begin, arena.size()))
+        {
+            auto l = arena[i];
+            int v = l.var(), s;
+            if (v >= aux)
+                v -= aux, s = Template::AUXILIARY;
+            else if (v >= c.vertex && v < c.end)
+                v -= c.vertex, s = Template::CURRENT;
+            else if (v >= p.vertex && v < p.end)
+                v -= p.vertex, s = Template::PREVIOUS;
+            else
+                s = Template::ABSOLUTE;
+            into.clauses.push_back(v << 3 | l.sign() << 2 | s);
+        }
+    }
+
+    // Adds recorded clauses with the segments of their literals based at the given variables
+    void paste(const int *it, const int *end, const int *tag, const int (&base)[4])
+    {
+        for (; it != end; ++tag)
+        {
+            for (int n = *it++; n; --n, ++it)
+                arena.emplace_back(base[*it & 3] + (*it >> 3), *it >> 2 & 1);
+            in_amo = *tag & 1;
+            add_clause((*tag >> 1) - 1);
+        }
+        in_amo = false;
+    }
+
+    bool replay(int t)
+    {
+        if (step.shape.empty() || shape(t - 1) != step.shape || shape(t) != step.shape)
+            return false;
+        const int base[] = {layers[t - 1].vertex, layers[t].vertex, aux(step.n_aux), 0};
+        for (int i : range(Stats::N_FAMILIES))
+            stats.by_family[i].n_aux += step.n_aux_by_family[i];
+        Family f(*this, Stats::REPLAY);
+        paste(step.clauses.data(), step.clauses.data() + step.clauses.size(), step.families.data(), base);
+        return true;
+    }
+
+    // Every time step encoded is stored in the cache, if configured, and loaded from it
+    // by later runs of the same instance and encoding. A step is stored as its number of
+    // auxiliary variables, those per family, the length of its clauses, its clauses and
+    // their families, as in Template.
+    std::unique_ptr<Cache> cache;
+    vector<vector<int32_t>> fresh; // Steps following the cached ones
+    Template *caching = nullptr;    // Step being recorded for the cache
+    int caching_aux = 0;
+
+    // Identifies the instance and the flags the clauses of a time step depend on
+    vector<int32_t> cache_key() const
+    {
+        vector<int32_t> ret = {static_cast<int>(V.size()), static_cast<int>(C.size()), static_cast<int>(A.size())};
+        ret.insert(ret.end(), s.begin(), s.end());
+        ret.insert(ret.end(), g.begin(), g.end());
+        ret.insert(ret.end(), adj.offsets.begin(), adj.offsets.end());
+        ret.insert(ret.end(), adj.heads.begin(), adj.heads.end());
+        for (bool flag : {config.prep, config.transport, config.edge_vars, config.move_vars,
+                          config.fixed_agent, config.fixed_container, config.blocking_containers,
+                          config.edge_reservation, config.edge_traversal, config.lazy})
+            ret.push_back(flag);
+        ret.push_back(config.amo);
+        return ret;
+    }
+
+    void restore(int t)
+    {
+        auto [it, end] = (*cache)[t];
+        int n_aux = *it++;
+        for (int i : range(Stats::N_FAMILIES))
+            stats.by_family[i].n_aux += *it++;
+        const int base[] = {layers[t ? t - 1 : t].vertex, layers[t].vertex, aux(n_aux), 0};
+        Family f(*this, Stats::REPLAY);
+        int n = *it++;
+        paste(it, it + n, it + n, base);
+        ++stats.n_cached;
+    }
+
+    // Selector variables done[c][t]: Container c is at its goal from time step t on.
+    // Backward pruning is attached to the largest makespan it is valid for, that is, c
+    // cannot occupy vertices from which its goal is out of reach in time. If c is carried
+    // by a single agent, that agent also has to reach the start of c in time while c has
+    // not left it. Queries for smaller makespans imply it along the chain of selectors.
+    vector<vector<int>> done;
+    vector<vector<vector<int>>> by_goal, by_start; // Vertices by distance per container
+
+    void init_horizon()
+    {
+        done.resize(C.size());
+        if (!config.prep)
+            return;
+        auto buckets = [&](const uint16_t *dist)
+        {
+            vector<vector<int>> ret;
+            for (auto v : V)
+                if (dist[v] != Distances::none)
+                {
+                    ret.resize(std::max<int>(ret.size(), dist[v] + 1));
+                    ret[dist[v]].push_back(v);
+                }
+            return ret;
+        };
+        for (auto c : C)
+        {
+            by_goal.push_back(buckets(to_goal[c]));
+            by_start.push_back(buckets(to_start[c]));
+        }
+    }
+
+    void horizon(int t)
+    {
+        Family f(*this, Stats::HORIZON);
+        for (auto c : C)
+        {
+            Lit d(aux(1));
+            done[c].push_back(d.a);
+            add({!d, Lit(c, g[c], t)});
+            if (t)
+                add({!Lit(done[c][t - 1]), d});
+            if (!config.prep)
+                continue;
+            for (int i : range(0, reachable(c, t)))
+                if (int v = order[c][i]; to_goal[c][v] == Distances::none)
+                    add({!Lit(c, v, t)});
+            for (auto u : range(t + 1))
+            {
+                int k = t - u + 1;
+                if (k < static_cast<int>(by_goal[c].size()))
+                    for (auto v : by_goal[c][k])
+                        add({!d, !Lit(c, v, u)});
+                if (!config.fixed_agent || s[c] == g[c] || !alive(Var(c, s[c], u)))
+                    continue;
+                k -= to_goal[c][s[c]];
+                if (k >= 0 && k < static_cast<int>(by_start[c].size()))
+                    for (auto v : by_start[c][k])
+                        for (auto a : A)
+                            add({!d, !Lit(c, a), !Lit(a, v, u), !Lit(c, s[c], u)});
+            }
+        }
+    }
+
     void extend(int t)
     {
+        Phase p(*this, EXTEND);
         while (t > T)
         {
+            if (stopped())
+                throw interrupted_e(stats);
+            if (cancelled)
+                return;
             ++T;
-            if (config.prep)
-                preprocessed(T);
+            if (T == static_cast<int>(layers.size()))
+                allocate_layer();
+            if (cache && T < cache->size())
+            {
+                restore(T);
+                horizon(T);
+                continue;
+            }
+            int n_vars = solver->nVars();
+            auto before = stats.by_family;
+            Template cached;
+            if (cache)
+            {
+                caching = &cached;
+                caching_aux = n_vars;
+            }
+            if (T && replay(T))
+            {
+                store(cached, n_vars, before);
+                horizon(T);
+                continue;
+            }
+            recording = T && step.shape.empty() && shape(T - 1) == shape(T);
             uniqueness(T);
             vertex_reservation(T);
             if (T)
@@ -628,14 +2289,30 @@ private:
                 if (config.transport)
                     transport(T - 1);
             }
+            if (recording)
+            {
+                step.shape = shape(T);
+                step.n_aux = solver->nVars() - n_vars;
+                for (int i : range(Stats::N_FAMILIES))
+                    step.n_aux_by_family[i] = stats.by_family[i].n_aux - before[i].n_aux;
+                recording = false;
+            }
+            store(cached, n_vars, before);
+            horizon(T);
         }
     }
 
-    void preprocessed(int t)
+    void store(Template &cached, int n_vars, const std::array<Stats::Counters, Stats::N_FAMILIES> &before)
     {
-        for (auto e : C_u_A)
-            for (auto v : V)
-                if (dist[e][v] > t)
-                    add_clause({!Lit(e, v, t)});
+        if (!caching)
+            return;
+        caching = nullptr;
+        vector<int32_t> words = {static_cast<int>(solver->nVars()) - n_vars};
+        for (int i : range(Stats::N_FAMILIES))
+            words.push_back(stats.by_family[i].n_aux - before[i].n_aux);
+        words.push_back(cached.clauses.size());
+        words.insert(words.end(), cached.clauses.begin(), cached.clauses.end());
+        words.insert(words.end(), cached.families.begin(), cached.families.end());
+        fresh.push_back(std::move(words));
     }
 };
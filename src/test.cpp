@@ -1,14 +1,43 @@
 #include <map>
+#include <set>
 #include <fstream>
+#include <filesystem>
 #include <array>
+#include <stdexcept>
 
 #include "Solver.hpp"
+#include "Batch.hpp"
+
+const vector<string> key_columns = {"g", "b", "a", "c", "seed", "config"};
+
+const vector<string> query_columns = []
+{
+    vector<string> columns = key_columns;
+    columns.insert(columns.end(), Stats::query_fields.begin(), Stats::query_fields.end());
+    return columns;
+}();
+
+// One row per makespan query, identified by the instance columns of csv
+void write_timeline(Csv *timeline, Csv *csv, Stats &stats)
+{
+    if (!timeline || !csv)
+        return;
+    for (auto &q : stats.queries)
+    {
+        timeline->clear();
+        for (auto &k : key_columns)
+            timeline->set(string(k), csv->fields[k]);
+        for (auto s : Stats::get_all(q))
+            timeline->set(std::move(s.first), s.second);
+        timeline->write();
+    }
+}
 
 template <typename... Args>
-optional<Solution> solve(Csv *csv, Args... args)
+optional<Solution> solve(std::ostream &log, Csv *csv, Csv *timeline, Args... args)
 {
     Solver p(args...);
-    if (!csv)
+    if (!csv && &log == &std::cout)
         p.print_grid();
     try
     {
@@ -20,7 +49,8 @@ optional<Solution> solve(Csv *csv, Args... args)
                 csv->set(std::move(s.first), s.second);
             csv->write();
         }
-        solution.stats.print();
+        write_timeline(timeline, csv, solution.stats);
+        solution.stats.print(log);
         return solution;
     }
     catch (unsolvable_e)
@@ -30,8 +60,8 @@ optional<Solution> solve(Csv *csv, Args... args)
             csv->set("result", "Unsolvable");
             csv->write();
         }
-        std::cout << std::endl
-                  << "Unsolvable!" << std::endl;
+        log << std::endl
+            << "Unsolvable!" << std::endl;
     }
     catch (partially_solved &e)
     {
@@ -43,9 +73,10 @@ optional<Solution> solve(Csv *csv, Args... args)
                 csv->set(std::move(s.first), s.second);
             csv->write();
         }
-        std::cout << std::endl
-                  << t << std::endl;
-        e.stats.print();
+        write_timeline(timeline, csv, e.stats);
+        log << std::endl
+            << t << std::endl;
+        e.stats.print(log);
     }
     return std::nullopt;
 }
@@ -56,7 +87,7 @@ void example1(Csv *csv = nullptr) // Figure 1
     vector<int> goal = {1, 0};
     vector<int> blokades = {3, 5, 6, 7, 8};
 
-    auto solution = solve(csv, Config(), 3, start, goal, blokades);
+    auto solution = solve(std::cout, csv, nullptr, Config(), 3, start, goal, blokades);
     assert(solution);
 
     auto v = solution.value();
@@ -71,7 +102,7 @@ void example2(Csv *csv = nullptr) // Figure 2
     vector<int> goal = {12, 1};
     vector<int> blokades = {6, 11};
 
-    auto solution = solve(csv, Config(), 4, start, goal, blokades);
+    auto solution = solve(std::cout, csv, nullptr, Config(), 4, start, goal, blokades);
     assert(solution);
 
     auto v = solution.value();
@@ -86,7 +117,7 @@ void counter(Csv *csv = nullptr)
     vector<int> goal = {2};
     vector<int> blockades = {3, 4, 5, 6, 7, 8};
 
-    auto solution = solve(csv, Config(), 3, start, goal, blockades);
+    auto solution = solve(std::cout, csv, nullptr, Config(), 3, start, goal, blockades);
     assert(solution);
 
     auto v = solution.value();
@@ -124,21 +155,26 @@ void grid_input(Csv *csv = nullptr, bool transport = true)
     constexpr static Config mapf = []
     { Config conf; conf.transport = false; return conf; }();
 
-    auto solution = solve(csv, transport ? mat : mapf, g, from_percentage(g, b), a, c, s);
+    auto solution = solve(std::cout, csv, nullptr, transport ? mat : mapf, g, from_percentage(g, b), a, c, s);
 
     if (solution)
         solution.value().visualize();
 }
 
+template <typename T = std::string>
+string instance_key(int g, int b, int a, int c, T seed, const string &config);
+
+// The formula of every instance is exported into a directory, if given, as iCNF with
+// a variable map next to it. Given a makespan, only the formula of this makespan is
+// exported as DIMACS instead of solving the instance.
 template <typename T = std::string>
 void grid_test(Csv *csv,
-               int g, int b, int a, int c, T seed = "", Config config = Config())
+               int g, int b, int a, int c, T seed = "", Config config = Config(), std::ostream &log = std::cout, Csv *timeline = nullptr,
+               const string &exports = "", int makespan = -1)
 {
-    std::cout << "────────────────────────────────────────────────────────────" << std::endl;
-    std::printf("g = %d, b = %d, a = %d, c = %d, seed = ", g, b, a, c);
-    std::cout << seed;
-    std::printf(", config = %s", config.fingerprint().c_str());
-    std::cout << std::endl;
+    log << "────────────────────────────────────────────────────────────" << std::endl;
+    log << "g = " << g << ", b = " << b << ", a = " << a << ", c = " << c << ", seed = " << seed;
+    log << ", config = " << config.fingerprint() << std::endl;
 
     if (csv)
     {
@@ -151,7 +187,35 @@ void grid_test(Csv *csv,
         csv->set("config", config.fingerprint());
     }
 
-    solve(csv, config, g, from_percentage(g, b), a, c, seed);
+    std::ofstream icnf, var_map;
+    if (exports.size())
+    {
+        auto path = std::filesystem::path(exports) / instance_key(g, b, a, c, seed, config.fingerprint());
+        var_map.open(path.string() + ".map");
+        config.var_map = &var_map;
+        if (makespan >= 0)
+        {
+            std::ofstream cnf(path.string() + ".cnf");
+            try
+            {
+                Solver(config, g, from_percentage(g, b), a, c, seed).dimacs(makespan, cnf);
+                log << "Exported t = " << makespan << std::endl;
+            }
+            catch (unsolvable_e)
+            {
+                log << "Unsolvable!" << std::endl;
+            }
+            catch (partially_solved &e)
+            {
+                log << e.what() << std::endl;
+            }
+            return;
+        }
+        icnf.open(path.string() + ".icnf");
+        config.icnf = &icnf;
+    }
+
+    solve(log, csv, timeline, config, g, from_percentage(g, b), a, c, seed);
 }
 
 template <typename T = std::string>
@@ -170,7 +234,7 @@ void regular_mapf(Csv *csv, T seed = "") // cf. Barták et al.
                     grid_test(csv, g, b, 0, c, seed, config);
 }
 
-constexpr unsigned N_CONFIGS = 7;
+constexpr unsigned N_CONFIGS = 9;
 
 constexpr std::array<Config, N_CONFIGS> configs = []
 {
@@ -179,7 +243,7 @@ constexpr std::array<Config, N_CONFIGS> configs = []
     for (bool prep : {false, true})
         for (double f : {1.5, 2.0})
             ret[i++] = Config(prep, f);
-    for (int e : {0, 2, 3})
+    for (int e : {0, 2, 3, 4, 5})
         ret[i++] = Config(e);
     return ret;
 }();
@@ -191,6 +255,60 @@ const vector<string> all_columns = []
     return columns;
 }();
 
+template <typename T>
+string instance_key(int g, int b, int a, int c, T seed, const string &config)
+{
+    std::stringstream ss;
+    ss << g << Csv::sep << b << Csv::sep << a << Csv::sep << c << Csv::sep << seed << Csv::sep << config;
+    return ss.str();
+}
+
+// Contents of a file up to its last complete line. A partial last row, left behind by an
+// interrupted run, is truncated.
+string truncate(const string &path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return "";
+    string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    auto n = content.rfind('\n');
+    content.resize(n == string::npos ? 0 : n + 1);
+    std::filesystem::resize_file(path, content.size());
+    return content;
+}
+
+// Instances with a row in an existing output file, identified regardless of the number
+// of threads. Returns std::nullopt if there is nothing to resume.
+optional<std::set<string>> completed(const string &path)
+{
+    auto content = truncate(path);
+    if (content.empty())
+        return std::nullopt;
+
+    std::stringstream ss(content);
+    string line;
+    std::getline(ss, line);
+    if (Csv::split(line) != all_columns)
+        throw std::runtime_error("Cannot resume " + path + ": columns differ");
+    vector<int> keys;
+    for (auto &k : key_columns)
+        keys.push_back(std::find(all_columns.begin(), all_columns.end(), k) - all_columns.begin());
+
+    std::set<string> ret;
+    while (std::getline(ss, line))
+    {
+        auto row = Csv::split(line);
+        if (row.size() != all_columns.size())
+            continue;
+        string key = row[keys[0]];
+        for (int i : range(1, keys.size()))
+            key += Csv::sep + (key_columns[i] == "config" ? Config::identity(row[keys[i]]) : row[keys[i]]);
+        ret.insert(key);
+    }
+    return ret;
+}
+
 int main(int argc, char **argv)
 {
     std::ofstream out;
@@ -252,6 +370,18 @@ command:
         case 'i' /*interactive*/:
             grid_input(get_csv(), transport);
             return 0;
+        case 'v' /*iew model*/:
+        {
+            // Grid size, blockades, agents, containers, seed, variable map, model and makespan
+            if (argc < i + 9)
+                throw std::runtime_error("View requires an instance, a variable map, a model and a makespan");
+            int g = atoi(argv[i + 1]), b = atoi(argv[i + 2]), a = transport ? atoi(argv[i + 3]) : 0, c = atoi(argv[i + 4]);
+            Problem problem(g, from_percentage(g, b), a, c, string(argv[i + 5]));
+            std::ifstream var_map(argv[i + 6]), model(argv[i + 7]);
+            int makespan = atoi(argv[i + 8]);
+            Solution(problem, makespan, decode(var_map, model, problem.C_u_A.size(), makespan), Stats()).visualize();
+        }
+            return 0;
         }
     else
     {
@@ -262,6 +392,15 @@ command:
     int g = 7;
     string s;
     Config conf;
+    unsigned n_probes = 1;
+    bool portfolio = false;
+    unsigned n_jobs = 1;
+    string trace_path;
+    bool perf = false;
+    auto backend = Backend::CRYPTOMINISAT;
+    string exports;
+    int makespan = -1;
+    string cache;
 
 option:
     if (argc > i + 2)
@@ -276,9 +415,44 @@ option:
         case 'c' /*onfig*/:
             conf = configs[atoi(argv[++i])];
             goto option;
+        case 'p' /*robes*/:
+            n_probes = atoi(argv[++i]);
+            goto option;
+        case 'r' /*ace*/:
+            portfolio = atoi(argv[++i]);
+            goto option;
+        case 'j' /*obs*/:
+            n_jobs = atoi(argv[++i]);
+            goto option;
+        case 't' /*race*/:
+            trace_path = argv[++i];
+            goto option;
+        case 'h' /*ardware counters*/:
+            perf = atoi(argv[++i]);
+            goto option;
+        case 'x' /*port*/:
+            exports = argv[++i];
+            std::filesystem::create_directories(exports);
+            goto option;
+        case 'm' /*akespan*/:
+            makespan = atoi(argv[++i]);
+            goto option;
+        case 'f' /*ormula cache*/:
+            cache = argv[++i];
+            std::filesystem::create_directories(cache);
+            goto option;
+        case 'e' /*ngine*/:
+            backend = tolower(argv[++i][0]) == 'i' ? Backend::IPASIR : Backend::CRYPTOMINISAT;
+            goto option;
         }
 
     conf.transport = transport;
+    conf.n_probes = n_probes;
+    conf.portfolio = portfolio;
+    conf.perf = perf;
+    conf.backend = backend;
+    if (cache.size())
+        conf.cache = cache.c_str();
     if (mapd)
     {
         conf.fixed_agent = true;
@@ -293,11 +467,55 @@ option:
     {
         conf.fixed_agent = true;
     }
-    auto csv_p = get_csv();
+    std::ofstream trace_file;
+    optional<Trace> trace;
+    if (trace_path.size())
+    {
+        trace_file.open(trace_path);
+        conf.trace = &trace.emplace(trace_file);
+    }
+    if (n_jobs > 1)
+    {
+        // Split the cores between concurrent instances and their solvers. The peak memory of
+        // the process would be that of all instances together, so it is not reported.
+        conf.log = false;
+        conf.rss = false;
+        conf.n_threads = std::max(1u, Batch::cores() / n_jobs / (portfolio ? Config::N_ENCODINGS : n_probes));
+    }
+
+    // An existing output file is resumed: instances with a row are skipped, others appended.
+    // The queries of each instance are written to a sidecar file next to it.
+    Csv *csv_p = nullptr;
+    std::set<string> done;
+    std::ofstream queries;
+    if (argc > i + 1)
+    {
+        string path = argv[++i];
+        auto resumed = completed(path);
+        out.open(path, std::ios::app);
+        if (resumed)
+            done = std::move(resumed.value());
+        else
+            csv.write_header();
+        csv_p = &csv;
+
+        string sidecar = path.substr(0, path.rfind(".csv")) + ".queries.csv";
+        bool empty = truncate(sidecar).empty();
+        queries.open(sidecar, std::ios::app);
+        if (empty)
+            Csv(query_columns, queries).write_header();
+    }
 
+    // Rows are matched by instance when resuming, so they are written as soon as their
+    // instance has finished and a preemption only loses the running instances
+    Batch batch(n_jobs, {&std::cout, &out, &queries}, !csv_p);
     for (int b : {10, 20})
         for (int a : transport ? range(1, 10 + 1) : range(1))
             for (int c : range(1, 10 + 1))
-                if (g * g - from_percentage(g, b) >= std::max(a, c))
-                    grid_test(csv_p, g, b, a, c, s, conf);
+                if (g * g - from_percentage(g, b) >= std::max(a, c) && !done.count(instance_key(g, b, a, c, s, Config::identity(conf.fingerprint()))))
+                    batch.add([=](vector<std::ostream *> &sinks)
+                              {
+                                  Csv row(all_columns, *sinks[1]), timeline(query_columns, *sinks[2]);
+                                  grid_test(csv_p ? &row : nullptr, g, b, a, c, s, conf, *sinks[0], csv_p ? &timeline : nullptr, exports, makespan); });
+    batch.run();
 }
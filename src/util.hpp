@@ -4,6 +4,7 @@
 #include <string>
 #include <optional>
 #include <utility>
+#include <type_traits>
 
 #include <ostream>
 
@@ -64,6 +65,27 @@ private:
     int from, to;
 };
 
+template <typename T>
+struct is_vector : std::false_type
+{
+};
+
+template <typename T>
+struct is_vector<vector<T>> : std::true_type
+{
+};
+
+// Heap memory held by a (nested) vector
+template <typename T>
+size_t heap_size(const vector<T> &v)
+{
+    size_t ret = v.capacity() * sizeof(T);
+    if constexpr (is_vector<T>::value)
+        for (auto &w : v)
+            ret += heap_size(w);
+    return ret;
+}
+
 template <typename T1, typename T2>
 std::pair<T2, T1> swap(const std::pair<T1, T2> &p)
 {
@@ -217,16 +239,28 @@ struct Csv
         out << std::endl;
     }
 
+    // Rows are written and flushed as a whole
     void write()
     {
         auto i = columns.begin();
         auto e = columns.end();
         if (i == e)
             return;
-        out << fields[*i];
+        string row = fields[*i];
         for (++i; i != e; ++i)
-            out << sep << fields[*i];
-        out << std::endl;
+            row += sep + fields[*i];
+        out << row + "\n" << std::flush;
+    }
+
+    static vector<string> split(const string &row)
+    {
+        vector<string> ret(1);
+        for (char c : row)
+            if (c == *sep)
+                ret.emplace_back();
+            else
+                ret.back() += c;
+        return ret;
     }
 };
 